@@ -0,0 +1,200 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Socket helpers for the benchmarks in this directory, so they don't need
+ * any other Lua module. */
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+static int pushError(lua_State *L) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    
+    return 2;
+}
+
+static int setNonBlock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) return -1;
+    
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/** benchutil.socketpair()
+ * Returns two connected, non-blocking unix stream sockets.
+ **/
+static int bu_socketpair(lua_State *L) {
+    int fds[2];
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) return pushError(L);
+    if (setNonBlock(fds[0]) == -1 || setNonBlock(fds[1]) == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return pushError(L);
+    }
+    
+    lua_pushnumber(L, fds[0]);
+    lua_pushnumber(L, fds[1]);
+    
+    return 2;
+}
+
+/** benchutil.pipe()
+ * Returns the non-blocking read and write ends of a pipe.
+ **/
+static int bu_pipe(lua_State *L) {
+    int fds[2];
+    
+    if (pipe(fds) == -1) return pushError(L);
+    if (setNonBlock(fds[0]) == -1 || setNonBlock(fds[1]) == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return pushError(L);
+    }
+    
+    lua_pushnumber(L, fds[0]);
+    lua_pushnumber(L, fds[1]);
+    
+    return 2;
+}
+
+/** benchutil.write(fd, data)
+ * Returns the number of bytes written (0 if the socket is full).
+ **/
+static int bu_write(lua_State *L) {
+    int fd = luaL_checknumber(L, 1);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+    
+    ssize_t n = write(fd, data, len);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) n = 0;
+        else return pushError(L);
+    }
+    lua_pushnumber(L, n);
+    
+    return 1;
+}
+
+/** benchutil.read(fd [, size])
+ * Returns the data read ("" if there is nothing to read), or nil at EOF.
+ **/
+static int bu_read(lua_State *L) {
+    int fd = luaL_checknumber(L, 1);
+    char buf[65536];
+    size_t size = luaL_optnumber(L, 2, sizeof(buf));
+    if (size > sizeof(buf)) size = sizeof(buf);
+    
+    ssize_t n = read(fd, buf, size);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) n = 0;
+        else return pushError(L);
+    } else if (n == 0 && size > 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushlstring(L, buf, n);
+    
+    return 1;
+}
+
+static int bu_close(lua_State *L) {
+    close(luaL_checknumber(L, 1));
+    
+    return 0;
+}
+
+/** benchutil.dup(fd)
+ * Returns a new descriptor for the open file of 'fd'.
+ **/
+static int bu_dup(lua_State *L) {
+    int fd = dup(luaL_checknumber(L, 1));
+    if (fd == -1) return pushError(L);
+    
+    lua_pushnumber(L, fd);
+    
+    return 1;
+}
+
+/** benchutil.now()
+ * Returns the monotonic time in seconds.
+ **/
+static int bu_now(lua_State *L) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    lua_pushnumber(L, ts.tv_sec + ts.tv_nsec / 1e9);
+    
+    return 1;
+}
+
+/** benchutil.memory()
+ * Returns the bytes allocated with malloc (nil if unknown) and the resident
+ * set size in bytes (nil if unknown).
+ **/
+static int bu_memory(lua_State *L) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+    lua_pushnumber(L, (double) (mi.uordblks + mi.hblkhd));
+#else
+    lua_pushnil(L);
+#endif
+    
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm && fscanf(statm, "%*s %ld", &pages) == 1) {
+        lua_pushnumber(L, (double) pages * sysconf(_SC_PAGESIZE));
+    } else {
+        lua_pushnil(L);
+    }
+    if (statm) fclose(statm);
+    
+    return 2;
+}
+
+static const struct luaL_Reg benchutil [] = {
+    {"socketpair", bu_socketpair},
+    {"pipe", bu_pipe},
+    {"memory", bu_memory},
+    {"write", bu_write},
+    {"read", bu_read},
+    {"close", bu_close},
+    {"dup", bu_dup},
+    {"now", bu_now},
+    {NULL, NULL}
+};
+
+LUALIB_API int luaopen_benchutil(lua_State *L) {
+    luaL_register(L, "benchutil", benchutil);
+    
+    return 1;
+}
@@ -0,0 +1,22 @@
+-- setlistener/rmlistener churn on an idle socket.
+
+return function(bench, backend, newloop)
+	local loop = newloop()
+	local a, b = benchutil.socketpair()
+	local function noop() end
+	
+	for _, mode in ipairs({"r", "rw"}) do
+		local rate = bench.rate(function()
+			for i = 1, 100 do
+				loop:setlistener(b, mode, noop)
+				loop:rmlistener(b, mode)
+			end
+			loop:poll({ms=0}) -- let batching backends submit their changes
+			return 100
+		end)
+		bench.report("churn", backend, mode, "set+rm/s", rate)
+	end
+	
+	benchutil.close(a)
+	benchutil.close(b)
+end
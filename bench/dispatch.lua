@@ -0,0 +1,34 @@
+-- Callbacks dispatched per second with N active descriptors: the sockets
+-- stay readable (level-triggered, never read), so every poll runs one
+-- callback per socket.
+
+return function(bench, backend, newloop)
+	for _, nfds in ipairs({1, 10, 100, 1000}) do
+		local loop = newloop()
+		local calls = 0
+		local socks = {}
+		
+		local function onread(loop, fd, mode)
+			calls = calls + 1
+		end
+		
+		for i = 1, nfds do
+			local a, b = benchutil.socketpair()
+			if not a then break end
+			benchutil.write(a, "x")
+			loop:setlistener(b, "r", onread)
+			socks[#socks + 1] = a
+			socks[#socks + 1] = b
+		end
+		
+		local rate = bench.rate(function()
+			local before = calls
+			loop:poll()
+			return calls - before
+		end)
+		bench.report("dispatch", backend, #socks / 2 .. " fds", "callbacks/s", rate)
+		
+		for i = 2, #socks, 2 do loop:rmlistener(socks[i], "r") end
+		for _, fd in ipairs(socks) do benchutil.close(fd) end
+	end
+end
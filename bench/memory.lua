@@ -0,0 +1,49 @@
+-- Memory used per loop, empty and with listeners on 100 sockets.
+-- malloc bytes are only known with glibc; rss includes the backend's rings
+-- and kernel buffers which aren't malloc'd.
+
+local LOOPS = 50
+
+local function measure()
+	collectgarbage()
+	collectgarbage()
+	local heap, rss = benchutil.memory()
+	return heap, rss, collectgarbage("count") * 1024
+end
+
+local function report(bench, backend, param, before, after)
+	bench.report("memory", backend, param, "lua bytes/loop", (after[3] - before[3]) / LOOPS)
+	if before[1] then
+		bench.report("memory", backend, param, "malloc bytes/loop", (after[1] - before[1]) / LOOPS)
+	end
+	if before[2] then
+		bench.report("memory", backend, param, "rss bytes/loop", (after[2] - before[2]) / LOOPS)
+	end
+end
+
+return function(bench, backend, newloop)
+	local loops = {}
+	local function noop() end
+	
+	local before = {measure()}
+	for i = 1, LOOPS do loops[i] = newloop() end
+	report(bench, backend, "empty", before, {measure()})
+	loops = {}
+	
+	local socks = {}
+	for i = 1, 100 do
+		local a, b = benchutil.socketpair()
+		socks[#socks + 1] = a
+		socks[#socks + 1] = b
+	end
+	before = {measure()}
+	for i = 1, LOOPS do
+		loops[i] = newloop()
+		for j = 2, #socks, 2 do loops[i]:setlistener(socks[j], "r", noop) end
+	end
+	report(bench, backend, "100 listeners", before, {measure()})
+	
+	loops = {}
+	collectgarbage()
+	for _, fd in ipairs(socks) do benchutil.close(fd) end
+end
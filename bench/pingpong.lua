@@ -0,0 +1,45 @@
+-- Round trips of one byte between two descriptors, each end answering
+-- from its read callback.
+
+return function(bench, backend, newloop)
+	-- return the read and write ends of 'a' and 'b', and all the fds
+	local makers = {
+		socketpair = function()
+			local a, b = benchutil.socketpair()
+			return a, a, b, b, {a, b}
+		end,
+		pipe = function()
+			local ar, bw = benchutil.pipe()
+			local br, aw = benchutil.pipe()
+			return ar, aw, br, bw, {ar, aw, br, bw}
+		end,
+	}
+	
+	for _, kind in ipairs({"socketpair", "pipe"}) do
+		local loop = newloop()
+		local ar, aw, br, bw, fds = makers[kind]()
+		local trips = 0
+		
+		loop:setlistener(br, "r", function()
+			benchutil.read(br, 1)
+			benchutil.write(bw, "x")
+		end)
+		loop:setlistener(ar, "r", function()
+			benchutil.read(ar, 1)
+			trips = trips + 1
+			benchutil.write(aw, "x")
+		end)
+		benchutil.write(aw, "x")
+		
+		local rate = bench.rate(function()
+			local before = trips
+			loop:poll()
+			return trips - before
+		end)
+		bench.report("pingpong", backend, kind, "roundtrips/s", rate)
+		
+		loop:rmlistener(ar, "r")
+		loop:rmlistener(br, "r")
+		for _, fd in ipairs(fds) do benchutil.close(fd) end
+	end
+end
@@ -0,0 +1,72 @@
+-- Runs the benchmarks of this directory against each available backend and
+-- prints one JSON object per line and result, e.g.
+--   {"bench":"pingpong","backend":"epoll","param":"socketpair","metric":"roundtrips/s","value":250000}
+-- so results of two versions can be compared with any JSON tool.
+--
+-- usage: lua bench/run.lua [backend|all] [seconds] [bench ...]
+-- Benchmarks: pingpong, dispatch, timers, churn, memory (all by default).
+-- Throughput is the best of 3 runs of 'seconds' (0.5 by default) each.
+
+require "luahop"
+require "benchutil"
+
+local BACKENDS = {"epoll", "io_uring", "kqueue"}
+local BENCHES = {"pingpong", "dispatch", "timers", "churn", "memory"}
+local ROUNDS = 3
+
+local dir = arg[0] and arg[0]:match("^(.*)/[^/]*$") or "bench"
+local only = arg[1] ~= "all" and arg[1] or nil
+local seconds = tonumber(arg[2]) or 0.5
+local names = {}
+for i = 3, #arg do names[#names + 1] = arg[i] end
+if #names == 0 then names = BENCHES end
+
+local function quote(v)
+	if type(v) == "number" then return string.format("%.10g", v) end
+	return '"' .. tostring(v):gsub('[%c"\\]', function(c)
+		return string.format("\\u%04x", c:byte())
+	end) .. '"'
+end
+
+local bench = {seconds = seconds}
+
+function bench.report(name, backend, param, metric, value)
+	print(string.format('{"bench":%s,"backend":%s,"param":%s,"metric":%s,"value":%s}',
+		quote(name), quote(backend), quote(param), quote(metric), quote(value)))
+	io.stdout:flush()
+end
+
+-- Calls step() until 'seconds' passed and returns the number of operations
+-- (the sum of what step() returned) per second; the best of ROUNDS runs.
+function bench.rate(step, setup)
+	local best = 0
+	for round = 1, ROUNDS do
+		if setup then setup() end
+		local ops, start, elapsed = 0, benchutil.now(), 0
+		repeat
+			ops = ops + step()
+			elapsed = benchutil.now() - start
+		until elapsed >= seconds
+		if ops / elapsed > best then best = ops / elapsed end
+	end
+	return best
+end
+
+local backends = {}
+for _, name in ipairs(BACKENDS) do
+	if (not only or only == name) and pcall(luahop.new, name) then
+		backends[#backends + 1] = name
+	end
+end
+if #backends == 0 then error("No such backend: " .. tostring(only)) end
+
+print(string.format('{"default_backend":%s,"lua":%s,"seconds":%s}',
+	quote(tostring(luahop.new()):match("<Hop Loop: (.*)>")), quote(_VERSION), quote(seconds)))
+
+for _, name in ipairs(names) do
+	local run = dofile(dir .. "/" .. name .. ".lua")
+	for _, backend in ipairs(backends) do
+		run(bench, backend, function() return luahop.new(backend) end)
+		collectgarbage()
+	end
+end
@@ -0,0 +1,26 @@
+-- Timer throughput: arming and cancelling timeouts, and expiring them.
+
+local N = 1000
+
+return function(bench, backend, newloop)
+	local loop = newloop()
+	local ids = {}
+	local function noop() end
+	
+	local rate = bench.rate(function()
+		for i = 1, N do ids[i] = loop:settimeout({s=60}, noop) end
+		for i = 1, N do loop:rmtimeout(ids[i]) end
+		return N
+	end)
+	bench.report("timers", backend, N .. " pending", "arm+cancel/s", rate)
+	
+	local fired = 0
+	local function onfire() fired = fired + 1 end
+	rate = bench.rate(function()
+		fired = 0
+		for i = 1, N do loop:settimeout({ms=1}, onfire) end
+		while fired < N do loop:poll() end
+		return N
+	end)
+	bench.report("timers", backend, N .. " at once", "expired/s", rate)
+end
@@ -0,0 +1,146 @@
+--[[ LuaJIT FFI fast path for luahop.
+
+hopffi.new([backend]) returns a loop whose plain "r", "w" and "rw"
+listeners are polled and dispatched through the C ABI of
+src/luahop_ffi.h, so a poll loop stays in compiled code. Everything else
+(timers, listeners with modifiers, the write queue...) goes to the classic
+binding, and runs in loop:dispatch() after the FFI events. On plain Lua,
+or if luahop was built without the ABI, hopffi.new is luahop.new.
+
+	local hopffi = require "hopffi"
+	local loop = hopffi.new()
+	loop:setlistener(fd, "r", function(loop, fd, mode) ... end)
+	loop:loop()
+]]
+
+local luahop = require "luahop"
+
+local hasffi, ffi = pcall(require, "ffi")
+if not hasffi then
+	return {new = luahop.new, ffi = false}
+end
+
+-- Keep in sync with src/luahop_ffi.h
+ffi.cdef[[
+typedef struct luahop_event {
+	int fd;
+	int mask;
+} luahop_event;
+
+int luahop_ffi_version(void);
+int luahop_ffi_listen(void *loop, int fd, int mask);
+void luahop_ffi_unlisten(void *loop, int fd, int mask);
+int luahop_ffi_poll(void *loop, long long timeout_ns, luahop_event *out, int max);
+int luahop_ffi_pending(void *loop);
+int luahop_ffi_stopped(void *loop);
+]]
+
+local VERSION = 1
+local MAX_EVENTS = 256 -- events dispatched per poll; the rest come next poll
+
+local function loadLib()
+	local path = package.searchpath and package.searchpath("luahop", package.cpath)
+	local ok, lib = pcall(ffi.load, path or "luahop")
+	if not ok then return nil end
+	local found, version = pcall(function() return lib.luahop_ffi_version() end)
+	if not found or version ~= VERSION then return nil end
+	return lib
+end
+
+local C = loadLib()
+if not C then
+	return {new = luahop.new, ffi = false}
+end
+
+local band = require("bit").band
+
+local masks = {r = 1, w = 2, rw = 3}
+local modes = {"r", "w", "rw"}
+
+local Loop = {}
+Loop.__index = Loop
+
+local classic = {} -- methods of the classic loop, set by the first new()
+
+setmetatable(Loop, {__index = function(Loop, key)
+	-- other methods go to the classic loop
+	local method = classic[key]
+	if type(method) ~= "function" then return nil end
+	local wrapper = function(self, ...) return method(self.hop, ...) end
+	Loop[key] = wrapper
+	return wrapper
+end})
+
+function Loop:setlistener(fd, mode, fn)
+	local mask = masks[mode]
+	if not mask then
+		if self.rfn[fd] or self.wfn[fd] then error("The fd has an FFI listener.", 2) end
+		return self.hop:setlistener(fd, mode, fn)
+	end
+	if type(fn) ~= "function" then error("Function was expected.", 2) end
+	if C.luahop_ffi_listen(self.ptr, fd, mask) ~= 0 then
+		error("Could not add event listener.", 2)
+	end
+	if band(mask, 1) ~= 0 then self.rfn[fd] = fn end
+	if band(mask, 2) ~= 0 then self.wfn[fd] = fn end
+end
+
+function Loop:rmlistener(fd, mode)
+	local mask = masks[mode]
+	if not mask or not (self.rfn[fd] or self.wfn[fd]) then
+		return self.hop:rmlistener(fd, mode)
+	end
+	C.luahop_ffi_unlisten(self.ptr, fd, mask)
+	if band(mask, 1) ~= 0 then self.rfn[fd] = nil end
+	if band(mask, 2) ~= 0 then self.wfn[fd] = nil end
+end
+
+local function toNanos(timeout)
+	if type(timeout) ~= "table" then return -1 end
+	local ms = (timeout.us or 0) / 1e3 + (timeout.ms or 0) + (timeout.s or 0) * 1e3 +
+		(timeout.m or 0) * 60e3 + (timeout.h or 0) * 3600e3
+	return ms > 0 and ms * 1e6 or 0
+end
+
+function Loop:poll(timeout)
+	local events, rfn, wfn = self.events, self.rfn, self.wfn
+	local n = C.luahop_ffi_poll(self.ptr, toNanos(timeout), events, MAX_EVENTS)
+	
+	for i = 0, n - 1 do
+		-- same rules as the classic dispatch: a callback set for "rw" runs
+		-- once, and callbacks may remove the listeners of later events
+		local fd, mask = events[i].fd, events[i].mask
+		local r = band(mask, 1) ~= 0 and rfn[fd]
+		if r then r(self, fd, modes[mask]) end
+		if band(mask, 2) ~= 0 then
+			local w = wfn[fd]
+			if w and w ~= r then w(self, fd, modes[mask]) end
+		end
+	end
+	if C.luahop_ffi_pending(self.ptr) ~= 0 then self.hop:dispatch() end
+end
+
+function Loop:loop()
+	C.luahop_ffi_stopped(self.ptr)
+	repeat
+		self:poll()
+	until C.luahop_ffi_stopped(self.ptr) ~= 0
+end
+
+function Loop.__tostring(self)
+	return tostring(self.hop)
+end
+
+local function new(backend)
+	local hop = luahop.new(backend)
+	classic = getmetatable(hop).__index
+	return setmetatable({
+		hop = hop, -- keeps the loop alive while ptr is used
+		ptr = ffi.cast("void *", hop),
+		events = ffi.new("luahop_event[?]", MAX_EVENTS),
+		rfn = {},
+		wfn = {},
+	}, Loop)
+end
+
+return {new = new, ffi = true}
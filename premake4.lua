@@ -20,4 +20,44 @@ project "LuaHop"
     
     configuration { "linux" }
         includedirs { "/usr/include/lua5.1" }
+        links { "pthread" }
         targetdir "build/linux"
+
+project "BenchUtil"
+    kind "SharedLib"
+    language "c"
+    location "build"
+    files { "bench/*.c" }
+    targetprefix ""
+    targetname "benchutil"
+    
+    configuration { "macosx" }
+        targetdir "build/macosx"
+        targetextension ".so"
+        linkoptions { "-single_module", "-undefined dynamic_lookup" }
+    
+    configuration { "linux" }
+        includedirs { "/usr/include/lua5.1" }
+        targetdir "build/linux"
+
+newaction {
+    trigger = "bench",
+    description = "Run the benchmarks in bench/ against the built modules",
+    execute = function()
+        local dir = os.is("macosx") and "build/macosx" or "build/linux"
+        os.execute("LUA_CPATH='" .. dir .. "/?.so;;' lua bench/run.lua all")
+    end
+}
+
+newaction {
+    trigger = "test",
+    description = "Run the regression tests in test/ against the built modules",
+    execute = function()
+        local dir = os.is("macosx") and "build/macosx" or "build/linux"
+        for _, file in ipairs(os.matchfiles("test/*.lua")) do
+            if os.execute("LUA_CPATH='" .. dir .. "/?.so;;' lua " .. file) ~= 0 then
+                error(file .. " failed", 0)
+            end
+        end
+    end
+}
@@ -0,0 +1,349 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+
+#define SN_BUFFER_MT "pl.makenika.hopbuffer"
+
+/* Free slabs of one size class, linked through their first bytes */
+typedef struct snSlab {
+    struct snSlab *next;
+} snSlab;
+
+struct snBufferPool {
+    int refs; /* the loop and every live buffer hold one */
+    size_t cached; /* bytes in the free lists */
+    snSlab *free[SN_SLAB_CLASSES];
+};
+
+snBufferPool *snBufferPoolCreate(void) {
+    snBufferPool *pool = calloc(1, sizeof(snBufferPool));
+    if (pool) pool->refs = 1;
+    
+    return pool;
+}
+
+void snBufferPoolRelease(snBufferPool *pool) {
+    int i;
+    
+    if (--pool->refs > 0) return;
+    for (i = 0; i < SN_SLAB_CLASSES; i++) {
+        while (pool->free[i]) {
+            snSlab *slab = pool->free[i];
+            pool->free[i] = slab->next;
+            free(slab);
+        }
+    }
+    free(pool);
+}
+
+/** Returns the size class for 'size' bytes (rounding 'size' up to the slab
+ * size), or -1 if slabs that big aren't pooled.
+ **/
+static int getSlabClass(size_t *size) {
+    size_t slab = (size_t) 1 << SN_SLAB_MIN_SHIFT;
+    int class = 0;
+    
+    while (slab < *size) {
+        slab <<= 1;
+        class++;
+    }
+    *size = slab;
+    
+    return class < SN_SLAB_CLASSES ? class : -1;
+}
+
+static char *allocSlab(snBufferPool *pool, size_t *size) {
+    int class = getSlabClass(size);
+    
+    if (class != -1 && pool->free[class]) {
+        snSlab *slab = pool->free[class];
+        pool->free[class] = slab->next;
+        pool->cached -= *size;
+        return (char *) slab;
+    }
+    
+    return malloc(*size);
+}
+
+static void freeSlab(snBufferPool *pool, char *data, size_t size) {
+    int class = getSlabClass(&size);
+    
+    if (class == -1 || pool->cached + size > SN_POOL_CACHE) {
+        free(data);
+        return;
+    }
+    snSlab *slab = (snSlab *) data;
+    slab->next = pool->free[class];
+    pool->free[class] = slab;
+    pool->cached += size;
+}
+
+/** Pushes a new buffer which holds at least 'size' bytes, or returns NULL.
+ **/
+snBuffer *snPushBuffer(lua_State *L, snBufferPool *pool, size_t size) {
+    snBuffer *buf = lua_newuserdata(L, sizeof(snBuffer));
+    
+    buf->data = allocSlab(pool, &size);
+    if (!buf->data) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    buf->pool = pool;
+    buf->size = size;
+    buf->start = 0;
+    buf->len = 0;
+    pool->refs++;
+    luaL_getmetatable(L, SN_BUFFER_MT);
+    lua_setmetatable(L, -2);
+    
+    return buf;
+}
+
+snBuffer *snCheckBuffer(lua_State *L, int idx) {
+    snBuffer *buf = luaL_checkudata(L, idx, SN_BUFFER_MT);
+    if (!buf->data) luaL_error(L, "The buffer is released.");
+    
+    return buf;
+}
+
+/** Makes room for 'n' more bytes after the contents, moving them to the
+ * start of the slab or to a bigger slab. Returns 0, or -1 when out of memory.
+ **/
+int snBufferReserve(snBuffer *buf, size_t n) {
+    if (buf->start + buf->len + n <= buf->size) return 0;
+    
+    if (buf->len + n <= buf->size) {
+        memmove(buf->data, buf->data + buf->start, buf->len);
+        buf->start = 0;
+        return 0;
+    }
+    
+    size_t size = buf->len + n;
+    char *data = allocSlab(buf->pool, &size);
+    if (!data) return -1;
+    memcpy(data, buf->data + buf->start, buf->len);
+    freeSlab(buf->pool, buf->data, buf->size);
+    buf->data = data;
+    buf->size = size;
+    buf->start = 0;
+    
+    return 0;
+}
+
+/** Converts a Lua position (1-based, negative from the end) to an offset in
+ * the contents; positions out of range are clamped.
+ **/
+static size_t getOffset(lua_Integer pos, size_t len) {
+    if (pos < 0) pos += (lua_Integer) len + 1;
+    if (pos < 1) return 0;
+    if ((size_t) pos > len) return len;
+    
+    return (size_t) pos - 1;
+}
+
+/** buf:find(str[, init])
+ * Returns the position of the plain string 'str', or nil.
+ **/
+static int buffer_find(lua_State *L) {
+    snBuffer *buf = snCheckBuffer(L, 1);
+    size_t slen, i;
+    const char *s = luaL_checklstring(L, 2, &slen);
+    size_t init = getOffset(luaL_optinteger(L, 3, 1), buf->len);
+    const char *data = buf->data + buf->start;
+    
+    if (slen == 0) {
+        lua_pushinteger(L, init + 1);
+        return 1;
+    }
+    for (i = init; i + slen <= buf->len; i++) {
+        const char *p = memchr(data + i, s[0], buf->len - slen - i + 1);
+        if (!p) break;
+        i = p - data;
+        if (memcmp(p, s, slen) == 0) {
+            lua_pushinteger(L, i + 1);
+            return 1;
+        }
+    }
+    lua_pushnil(L);
+    
+    return 1;
+}
+
+/** buf:byte([i])
+ * Returns the byte at 'i' (1 by default), or nil.
+ **/
+static int buffer_byte(lua_State *L) {
+    snBuffer *buf = snCheckBuffer(L, 1);
+    lua_Integer pos = luaL_optinteger(L, 2, 1);
+    
+    if (pos < 0) pos += (lua_Integer) buf->len + 1;
+    if (pos < 1 || (size_t) pos > buf->len) return 0;
+    lua_pushinteger(L, (unsigned char) buf->data[buf->start + pos - 1]);
+    
+    return 1;
+}
+
+/** buf:slice([i[, j]])
+ * Returns bytes i to j as a string, like string.sub.
+ **/
+static int buffer_slice(lua_State *L) {
+    snBuffer *buf = snCheckBuffer(L, 1);
+    size_t from = getOffset(luaL_optinteger(L, 2, 1), buf->len);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+    size_t to = j < 0 ? getOffset(j, buf->len) + 1 : ((size_t) j > buf->len ? buf->len : (size_t) j);
+    
+    if (to <= from) lua_pushliteral(L, "");
+    else lua_pushlstring(L, buf->data + buf->start + from, to - from);
+    
+    return 1;
+}
+
+/** buf:toint([i[, j[, base]]])
+ * Parses an integer from bytes i to j (leading spaces and a sign are
+ * allowed, base 10 by default). Returns the number and the position after
+ * it, or nil if there are no digits.
+ **/
+static int buffer_toint(lua_State *L) {
+    snBuffer *buf = snCheckBuffer(L, 1);
+    size_t pos = getOffset(luaL_optinteger(L, 2, 1), buf->len);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+    size_t end = j < 0 ? getOffset(j, buf->len) + 1 : ((size_t) j > buf->len ? buf->len : (size_t) j);
+    int base = luaL_optint(L, 4, 10);
+    const char *data = buf->data + buf->start;
+    lua_Number n = 0;
+    int negative = 0, digits = 0;
+    
+    if (base < 2 || base > 36) return luaL_error(L, "Invalid base.");
+    while (pos < end && (data[pos] == ' ' || data[pos] == '\t')) pos++;
+    if (pos < end && (data[pos] == '-' || data[pos] == '+')) negative = data[pos++] == '-';
+    for (; pos < end; pos++, digits++) {
+        int c = (unsigned char) data[pos], d;
+        if (c >= '0' && c <= '9') d = c - '0';
+        else if (c >= 'a' && c <= 'z') d = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'Z') d = c - 'A' + 10;
+        else break;
+        if (d >= base) break;
+        n = n * base + d;
+    }
+    if (digits == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    
+    lua_pushnumber(L, negative ? -n : n);
+    lua_pushinteger(L, pos + 1);
+    
+    return 2;
+}
+
+/** buf:consume(n)
+ * Drops the first 'n' bytes (all of them if n is bigger).
+ **/
+static int buffer_consume(lua_State *L) {
+    snBuffer *buf = snCheckBuffer(L, 1);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    
+    if (n < 0) return luaL_error(L, "Invalid length.");
+    if ((size_t) n >= buf->len) {
+        buf->start = 0;
+        buf->len = 0;
+    } else {
+        buf->start += n;
+        buf->len -= n;
+    }
+    
+    return 0;
+}
+
+/** buf:append(str)
+ **/
+static int buffer_append(lua_State *L) {
+    snBuffer *buf = snCheckBuffer(L, 1);
+    size_t len;
+    const char *s = luaL_checklstring(L, 2, &len);
+    
+    if (snBufferReserve(buf, len) == -1) return luaL_error(L, "Out of memory.");
+    memcpy(buf->data + buf->start + buf->len, s, len);
+    buf->len += len;
+    
+    return 0;
+}
+
+/** buf:release()
+ * Gives the memory back to the pool of the loop; the buffer can't be used
+ * anymore. Collecting the buffer does the same.
+ **/
+static int buffer_release(lua_State *L) {
+    snBuffer *buf = luaL_checkudata(L, 1, SN_BUFFER_MT);
+    if (!buf->data) return 0;
+    
+    freeSlab(buf->pool, buf->data, buf->size);
+    snBufferPoolRelease(buf->pool);
+    buf->data = NULL;
+    buf->len = 0;
+    
+    return 0;
+}
+
+static int buffer_len(lua_State *L) {
+    snBuffer *buf = luaL_checkudata(L, 1, SN_BUFFER_MT);
+    lua_pushinteger(L, buf->len);
+    
+    return 1;
+}
+
+static int buffer_tostring(lua_State *L) {
+    snBuffer *buf = luaL_checkudata(L, 1, SN_BUFFER_MT);
+    
+    if (buf->data) lua_pushlstring(L, buf->data + buf->start, buf->len);
+    else lua_pushliteral(L, "");
+    
+    return 1;
+}
+
+static const struct luaL_Reg bufferlib_m [] = {
+    {"find", buffer_find},
+    {"byte", buffer_byte},
+    {"slice", buffer_slice},
+    {"toint", buffer_toint},
+    {"consume", buffer_consume},
+    {"append", buffer_append},
+    {"release", buffer_release},
+    {"__len", buffer_len},
+    {"__tostring", buffer_tostring},
+    {"__gc", buffer_release},
+    {NULL, NULL}
+};
+
+int snOpenBuffer(lua_State *L) {
+    luaL_newmetatable(L, SN_BUFFER_MT);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_register(L, NULL, bufferlib_m);
+    lua_pop(L, 1);
+    
+    return 0;
+}
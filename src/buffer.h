@@ -0,0 +1,53 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Byte buffers for reading sockets without creating Lua strings.
+ * Their memory comes from a slab pool of the loop: power-of-two slabs,
+ * which go back to the pool when a buffer is released or collected. */
+
+#ifndef __SN_BUFFER__
+#define __SN_BUFFER__
+
+#include <stddef.h>
+#include <lua.h>
+
+#define SN_SLAB_MIN_SHIFT 12 /* Smallest slab: 4 KiB */
+#define SN_SLAB_CLASSES 9 /* Slabs up to 1 MiB are pooled; bigger ones aren't */
+#define SN_POOL_CACHE (4 * 1024 * 1024) /* Bytes of free slabs a pool keeps */
+
+typedef struct snBufferPool snBufferPool;
+
+typedef struct snBuffer {
+    snBufferPool *pool;
+    char *data; /* NULL once released */
+    size_t size;
+    size_t start; /* The contents are data[start, start + len) */
+    size_t len;
+} snBuffer;
+
+snBufferPool *snBufferPoolCreate(void);
+void snBufferPoolRelease(snBufferPool *pool);
+snBuffer *snPushBuffer(lua_State *L, snBufferPool *pool, size_t size);
+snBuffer *snCheckBuffer(lua_State *L, int idx);
+int snBufferReserve(snBuffer *buf, size_t n);
+int snOpenBuffer(lua_State *L);
+
+#endif
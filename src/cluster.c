@@ -0,0 +1,367 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "cluster.h"
+
+#define checkCluster(L) (snCluster *)luaL_checkudata(L, 1, "pl.makenika.hopcluster")
+
+/* registry key of the worker, which runs in a given lua_State */
+#define SN_WORKER_KEY "pl.makenika.hopworker"
+
+struct snCluster;
+
+typedef struct snWorkerArg {
+    int type; /* LUA_TSTRING, LUA_TNUMBER or LUA_TBOOLEAN */
+    char *string;
+    size_t len;
+    lua_Number number;
+} snWorkerArg;
+
+typedef struct snWorker {
+    struct snCluster *cluster;
+    pthread_t thread;
+    int id; /* 1-based */
+    int cpu; /* -1 if not pinned */
+    int started;
+    int running;
+    char *error;
+    snWorkerStats stats;
+} snWorker;
+
+typedef struct snCluster {
+    char *script;
+    snWorkerArg *args;
+    int nargs;
+    snWorker *workers;
+    int nworkers;
+    int joined;
+} snCluster;
+
+/** Returns the counters of the worker running in 'L', or NULL if 'L' is
+ * not a cluster worker.
+ **/
+snWorkerStats *snGetWorkerStats(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, SN_WORKER_KEY);
+    snWorker *worker = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    
+    return worker ? &worker->stats : NULL;
+}
+
+void snCountPoll(snWorkerStats *stats, int nevents) {
+    __atomic_store_n(&stats->polls, stats->polls + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->events, stats->events + nevents, __ATOMIC_RELAXED);
+}
+
+static void pinWorker(snWorker *worker) {
+#ifdef __linux__
+    cpu_set_t set;
+    
+    if (worker->cpu < 0) return;
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+#else
+    worker->cpu = -1;
+#endif
+}
+
+/** Thread body: runs the cluster script as script(id, nworkers, args...)
+ **/
+static void *runWorker(void *arg) {
+    snWorker *worker = arg;
+    snCluster *cluster = worker->cluster;
+    int i;
+    
+    pinWorker(worker);
+    
+    lua_State *L = luaL_newstate();
+    if (!L) {
+        worker->error = strdup("Could not create Lua state.");
+        __atomic_store_n(&worker->running, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    luaL_openlibs(L);
+    lua_pushlightuserdata(L, worker);
+    lua_setfield(L, LUA_REGISTRYINDEX, SN_WORKER_KEY);
+    
+    int status = luaL_loadfile(L, cluster->script);
+    if (status == 0) {
+        lua_pushnumber(L, worker->id);
+        lua_pushnumber(L, cluster->nworkers);
+        for (i = 0; i < cluster->nargs; i++) {
+            snWorkerArg *a = &cluster->args[i];
+            if (a->type == LUA_TSTRING) lua_pushlstring(L, a->string, a->len);
+            else if (a->type == LUA_TNUMBER) lua_pushnumber(L, a->number);
+            else lua_pushboolean(L, (int) a->number);
+        }
+        status = lua_pcall(L, cluster->nargs + 2, 0, 0);
+    }
+    if (status != 0) {
+        const char *msg = lua_tostring(L, -1);
+        worker->error = strdup(msg ? msg : "Worker failed.");
+    }
+    
+    lua_close(L);
+    __atomic_store_n(&worker->running, 0, __ATOMIC_RELEASE);
+    
+    return NULL;
+}
+
+static void joinCluster(snCluster *cluster) {
+    int i;
+    
+    if (cluster->joined) return;
+    for (i = 0; i < cluster->nworkers; i++) {
+        if (cluster->workers[i].started) pthread_join(cluster->workers[i].thread, NULL);
+    }
+    cluster->joined = 1;
+}
+
+/** Reads the "args" array of the options table.
+ **/
+static void copyArgs(lua_State *L, snCluster *cluster) {
+    int i, n;
+    
+    lua_getfield(L, 1, "args");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    
+    n = lua_objlen(L, -1);
+    cluster->args = calloc(n > 0 ? n : 1, sizeof(snWorkerArg));
+    if (!cluster->args) return;
+    
+    for (i = 0; i < n; i++) {
+        snWorkerArg *a = &cluster->args[cluster->nargs];
+        lua_rawgeti(L, -1, i + 1);
+        a->type = lua_type(L, -1);
+        if (a->type == LUA_TNUMBER) {
+            a->number = lua_tonumber(L, -1);
+        } else if (a->type == LUA_TBOOLEAN) {
+            a->number = lua_toboolean(L, -1);
+        } else if (a->type == LUA_TSTRING) {
+            const char *s = lua_tolstring(L, -1, &a->len);
+            a->string = malloc(a->len + 1);
+            if (a->string) memcpy(a->string, s, a->len + 1);
+            else a->type = LUA_TNIL;
+        }
+        lua_pop(L, 1);
+        if (a->type == LUA_TNUMBER || a->type == LUA_TBOOLEAN || a->type == LUA_TSTRING) {
+            cluster->nargs++;
+        }
+    }
+    lua_pop(L, 1);
+}
+
+/** luahop.cluster{script="worker.lua", threads=4, pin=true, args={...}}
+ * Starts the workers and returns the cluster object.
+ * 'pin' can be true (worker N runs on cpu N-1) or an array of cpu numbers.
+ **/
+static int hop_cluster(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int i;
+    
+    snCluster *cluster = lua_newuserdata(L, sizeof(snCluster));
+    memset(cluster, 0, sizeof(snCluster));
+    luaL_getmetatable(L, "pl.makenika.hopcluster");
+    lua_setmetatable(L, -2);
+    
+    lua_getfield(L, 1, "script");
+    if (!lua_isstring(L, -1)) return luaL_error(L, "Cluster script was expected.");
+    cluster->script = strdup(lua_tostring(L, -1));
+    lua_pop(L, 1);
+    
+    lua_getfield(L, 1, "threads");
+    int nworkers = lua_isnumber(L, -1) ? (int) lua_tonumber(L, -1) :
+            (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) nworkers = 1;
+    lua_pop(L, 1);
+    
+    cluster->workers = calloc(nworkers, sizeof(snWorker));
+    if (!cluster->script || !cluster->workers) {
+        return luaL_error(L, "Could not create cluster.");
+    }
+    cluster->nworkers = nworkers;
+    copyArgs(L, cluster);
+    
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    lua_getfield(L, 1, "pin");
+    for (i = 0; i < nworkers; i++) {
+        snWorker *worker = &cluster->workers[i];
+        worker->cluster = cluster;
+        worker->id = i + 1;
+        worker->cpu = -1;
+        if (lua_istable(L, -1)) {
+            lua_rawgeti(L, -1, i + 1);
+            if (lua_isnumber(L, -1)) worker->cpu = (int) lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        } else if (lua_toboolean(L, -1) && ncpus > 0) {
+            worker->cpu = (int) (i % ncpus);
+        }
+    }
+    lua_pop(L, 1);
+    
+    for (i = 0; i < nworkers; i++) {
+        snWorker *worker = &cluster->workers[i];
+        worker->running = 1;
+        if (pthread_create(&worker->thread, NULL, runWorker, worker) != 0) {
+            worker->running = 0;
+            worker->error = strdup("Could not start thread.");
+            continue;
+        }
+        worker->started = 1;
+    }
+    
+    return 1;
+}
+
+/** Waits for all the workers to finish. Returns true, or false and
+ * a table with the error messages of the failed workers.
+ **/
+static int hop_clusterJoin(lua_State *L) {
+    snCluster *cluster = checkCluster(L);
+    int i, failed = 0;
+    
+    joinCluster(cluster);
+    
+    lua_newtable(L);
+    for (i = 0; i < cluster->nworkers; i++) {
+        if (!cluster->workers[i].error) continue;
+        lua_pushstring(L, cluster->workers[i].error);
+        lua_rawseti(L, -2, i + 1);
+        failed = 1;
+    }
+    
+    lua_pushboolean(L, !failed);
+    if (!failed) return 1;
+    lua_insert(L, -2);
+    return 2;
+}
+
+/** Returns an array of per-worker tables:
+ * {id=, cpu=, running=, polls=, events=, error=}
+ **/
+static int hop_clusterStats(lua_State *L) {
+    snCluster *cluster = checkCluster(L);
+    int i;
+    
+    lua_createtable(L, cluster->nworkers, 0);
+    for (i = 0; i < cluster->nworkers; i++) {
+        snWorker *worker = &cluster->workers[i];
+        int running = __atomic_load_n(&worker->running, __ATOMIC_ACQUIRE);
+        
+        lua_createtable(L, 0, 6);
+        lua_pushnumber(L, worker->id);
+        lua_setfield(L, -2, "id");
+        lua_pushnumber(L, worker->cpu);
+        lua_setfield(L, -2, "cpu");
+        lua_pushboolean(L, running);
+        lua_setfield(L, -2, "running");
+        lua_pushnumber(L, (lua_Number) __atomic_load_n(&worker->stats.polls, __ATOMIC_RELAXED));
+        lua_setfield(L, -2, "polls");
+        lua_pushnumber(L, (lua_Number) __atomic_load_n(&worker->stats.events, __ATOMIC_RELAXED));
+        lua_setfield(L, -2, "events");
+        if (!running && worker->error) {
+            lua_pushstring(L, worker->error);
+            lua_setfield(L, -2, "error");
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    
+    return 1;
+}
+
+static int hop_clusterSize(lua_State *L) {
+    snCluster *cluster = checkCluster(L);
+    lua_pushnumber(L, cluster->nworkers);
+    
+    return 1;
+}
+
+/** Workers reference the cluster, so collecting it waits for them.
+ **/
+static int hop_clusterGc(lua_State *L) {
+    snCluster *cluster = checkCluster(L);
+    int i;
+    
+    joinCluster(cluster);
+    for (i = 0; i < cluster->nworkers; i++) free(cluster->workers[i].error);
+    for (i = 0; i < cluster->nargs; i++) free(cluster->args[i].string);
+    free(cluster->workers);
+    free(cluster->args);
+    free(cluster->script);
+    
+    return 0;
+}
+
+/** Returns the id of the current worker and the number of workers,
+ * or nothing outside of a cluster.
+ **/
+static int hop_worker(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, SN_WORKER_KEY);
+    snWorker *worker = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (!worker) return 0;
+    
+    lua_pushnumber(L, worker->id);
+    lua_pushnumber(L, worker->cluster->nworkers);
+    
+    return 2;
+}
+
+static const struct luaL_Reg clusterlib_m [] = {
+    {"join", hop_clusterJoin},
+    {"stats", hop_clusterStats},
+    {"size", hop_clusterSize},
+    {"__gc", hop_clusterGc},
+    {NULL, NULL}
+};
+
+/** Adds the cluster functions to the luahop table, which is on the
+ * top of the stack.
+ **/
+int snOpenCluster(lua_State *L) {
+    luaL_newmetatable(L, "pl.makenika.hopcluster");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_register(L, NULL, clusterlib_m);
+    lua_pop(L, 1);
+    
+    lua_pushcfunction(L, hop_cluster);
+    lua_setfield(L, -2, "cluster");
+    lua_pushcfunction(L, hop_worker);
+    lua_setfield(L, -2, "worker");
+    
+    return 0;
+}
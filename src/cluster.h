@@ -0,0 +1,43 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Multi-core mode: a cluster runs the same Lua script in N OS threads.
+ * Every worker thread has its own lua_State (and its own loops), so Lua
+ * code is never shared between threads. Workers share the accept load by
+ * registering a common listening socket with the "+exclusive" modifier. */
+
+#ifndef __SN_CLUSTER__
+#define __SN_CLUSTER__
+
+#include <lua.h>
+
+/* Counters of a worker thread. They are written only by the worker, and
+ * read by the thread which owns the cluster. */
+typedef struct snWorkerStats {
+    unsigned long long polls;
+    unsigned long long events;
+} snWorkerStats;
+
+snWorkerStats *snGetWorkerStats(lua_State *L);
+void snCountPoll(snWorkerStats *stats, int nevents);
+int snOpenCluster(lua_State *L);
+
+#endif
@@ -8,6 +8,26 @@
 /* test for polling API */
 #ifdef __linux__
 #define HAVE_EPOLL 1
+#define HAVE_SIGNALFD 1
+#define HAVE_SENDFILE 1
+#define HAVE_ACCEPT4 1
+#define HAVE_MMSG 1 /* recvmmsg, sendmmsg */
+#endif
+
+/* epoll_pwait2 (Linux >= 5.11, glibc >= 2.35) takes a nanosecond timeout */
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define HAVE_EPOLL_PWAIT2 1
+#endif
+
+/* io_uring (Linux >= 5.13) is used by the epoll backend, when available */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_RSRC_TAGS
+#define HAVE_IO_URING 1
+#endif
+#endif
 #endif
 
 
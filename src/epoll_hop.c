@@ -30,37 +30,106 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <time.h>
-#include <sys/timerfd.h>
 #include <sys/epoll.h>
 #include "hoploop.h"
+#include "timerwheel.h"
 
+/* Interest changes are not sent to epoll right away. addEvent/removeEvent
+ * only put the fd on a changelist, which poll() flushes just before
+ * epoll_wait, comparing what the fd wants by then (hloop->events[fd].mask)
+ * with what epoll was told last. Changes which cancel each other out cost
+ * nothing, except for an fd nobody listens to anymore: it is deleted from
+ * epoll right away. epoll watches open file descriptions, so closing the fd
+ * later wouldn't remove it while a dup (or a forked child) still refers to
+ * the same one, and a reused fd number would get its events. */
+#define SN_EP_PENDING 1 /* the fd is on the changelist */
+#define SN_EP_REARM 2 /* a "+oneshot" fd has to be re-armed */
+
+typedef struct snEpollFd {
+    uint32_t registered; /* events epoll was told last; 0 if not added */
+    int flags;
+} snEpollFd;
+
+/* Timers live in a user-space timing wheel with 1 ms ticks. The wheel
+ * does not use any file descriptors; it only shortens the epoll_wait
+ * timeout, so that the nearest timer fires in time. */
 typedef struct snApiState {
     int epfd;
-    struct epoll_event events[SN_SETSIZE];
+    struct epoll_event *events; /* hloop->setsize slots */
+    snEpollFd *fds; /* hloop->setsize slots */
+    int *changes; /* fds waiting for the flush; each fd is there once */
+    int nchanges;
+    snTimerWheel wheel;
+    int nopwait2; /* epoll_pwait2 isn't supported by the kernel */
 } snApiState;
 
-static snHopLoop *createLoop() {
-    snHopLoop *loop = malloc(sizeof(snHopLoop));
+/** Returns the current tick of the timing wheel (monotonic milliseconds).
+ **/
+static int64_t getTick(void) {
+    return (int64_t) (snNanoTime() / 1000000);
+}
+
+/** Returns the tick timers are armed from: the current time rounded up to a
+ * full millisecond, so a timer never expires before its timeout elapsed.
+ **/
+static int64_t getArmTick(void) {
+    return (int64_t) ((snNanoTime() + 999999) / 1000000);
+}
+
+#ifdef HAVE_IO_URING
+static int createUringLoop(snHopLoop *hloop); /* defined in uring_hop.c */
+#endif
+
+static int createLoop(snHopLoop *hloop, const char *backend) {
+#ifdef HAVE_IO_URING
+    /* io_uring is preferred; epoll is used when the kernel lacks it */
+    if (backend == NULL || strcmp(backend, "io_uring") == 0) {
+        if (createUringLoop(hloop) == 0) return 0;
+        if (backend) return -1;
+    }
+#endif
+    if (backend && strcmp(backend, "epoll") != 0) return -1;
+    
     snLoopApi *api = malloc(sizeof(snLoopApi));
     snApiState *state = malloc(sizeof(snApiState));
     
-    if (! (loop && api)) {
-        return NULL;
+    if (! (api && state)) {
+        free(api);
+        free(state);
+        return -1;
     }
     
-    loop->api = api;
-    loop->state = state;
+    state->events = NULL;
+    state->fds = NULL;
+    state->changes = NULL;
+    state->nchanges = 0;
+    hloop->api = api;
+    hloop->state = state;
     
     api->name = "epoll";
+    api->closeLoop = closeLoop;
+    api->resize = resize;
+    api->addEvent = addEvent;
+    api->removeEvent = removeEvent;
+    api->rearmEvent = rearmEvent;
+    api->poll = poll;
+    api->setTimeout = setTimeout;
+    api->setInterval = setInterval;
+    api->clearTimer = clearTimer;
     
-    if (init(loop) < 0) {
-        return NULL;
+    if (init(hloop) < 0) {
+        free(api);
+        free(state);
+        return -1;
     }
     
-    return loop;
+    return 0;
 }
 
 static int init(struct snHopLoop * hloop) {
@@ -68,6 +137,7 @@ static int init(struct snHopLoop * hloop) {
     snApiState *state = hloop->state;
     if (epfd == -1) return -1;
     state->epfd = epfd;
+    snWheelInit(&state->wheel, getTick());
     
     return 0;
 }
@@ -75,132 +145,285 @@ static int init(struct snHopLoop * hloop) {
 static int closeLoop(struct snHopLoop *hloop) {
 	snApiState *state = hloop->state;
     close(state->epfd);
+    free(state->events);
+    free(state->fds);
+    free(state->changes);
+    snWheelFree(&state->wheel);
     
     return 0;
 }
 
-static int addEvent(struct snHopLoop *hloop, int fd, int mask) {
+static int resize(struct snHopLoop *hloop, int setsize) {
     snApiState *state = hloop->state;
+    struct epoll_event *events = realloc(state->events, sizeof(struct epoll_event) * setsize);
+    if (!events) return -1;
+    state->events = events;
+    
+    snEpollFd *fds = realloc(state->fds, sizeof(snEpollFd) * setsize);
+    if (!fds) return -1;
+    state->fds = fds;
+    memset(fds + hloop->setsize, 0, sizeof(snEpollFd) * (setsize - hloop->setsize));
+    
+    int *changes = realloc(state->changes, sizeof(int) * setsize);
+    if (!changes) return -1;
+    state->changes = changes;
+    
+    return 0;
+}
+
+/** Translates a listener mask, with its modifiers, to epoll events.
+ * Modifiers apply to the whole fd, since epoll has one entry per fd.
+ **/
+static uint32_t getEpollEvents(int mask) {
+    uint32_t events = 0;
+    
+    if (mask & SN_READABLE) events |= EPOLLIN;
+    if (mask & SN_WANTWRITE) events |= EPOLLOUT;
+    if (mask & SN_EDGE) events |= EPOLLET;
+    if (mask & SN_ONESHOT) events |= EPOLLONESHOT;
+    if (mask & SN_EXCLUSIVE) events |= EPOLLEXCLUSIVE;
+    
+    return events;
+}
+
+/** EPOLL_CTL_MOD; "+exclusive" fds can only be added, so they are
+ * deleted and added again.
+ **/
+static int modifyEvent(snApiState *state, int fd, struct epoll_event *ee) {
+    if (ee->events & EPOLLEXCLUSIVE) {
+        epoll_ctl(state->epfd,EPOLL_CTL_DEL,fd,ee);
+        return epoll_ctl(state->epfd,EPOLL_CTL_ADD,fd,ee);
+    }
+    
+    return epoll_ctl(state->epfd,EPOLL_CTL_MOD,fd,ee);
+}
+
+static int controlEvent(snApiState *state, int op, int fd, uint32_t events) {
     struct epoll_event ee;
-    /* If the fd was already monitored for some event, we need a MOD
-     * operation. Otherwise we need an ADD operation. */
-    int op = hloop->events[fd].mask == SN_NONE ?
-            EPOLL_CTL_ADD : EPOLL_CTL_MOD;
-
-    ee.events = 0;
-    mask |= hloop->events[fd].mask; /* Merge old events */
-    if (mask & SN_READABLE) ee.events |= EPOLLIN;
-    if (mask & SN_WRITABLE) ee.events |= EPOLLOUT;
+    
+    ee.events = events;
     ee.data.u64 = 0; /* avoid valgrind warning */
     ee.data.fd = fd;
-    if (epoll_ctl(state->epfd,op,fd,&ee) == -1) return -1;
+    
+    /* Note, Kernel < 2.6.9 requires a non null event pointer even for
+     * EPOLL_CTL_DEL. */
+    if (op == EPOLL_CTL_MOD) return modifyEvent(state, fd, &ee);
+    return epoll_ctl(state->epfd, op, fd, &ee);
+}
+
+static void queueChange(snApiState *state, int fd, int flags) {
+    snEpollFd *efd = &state->fds[fd];
+    
+    if (!(efd->flags & SN_EP_PENDING)) state->changes[state->nchanges++] = fd;
+    efd->flags |= SN_EP_PENDING | flags;
+}
+
+static int addEvent(struct snHopLoop *hloop, int fd, int mask) {
+    (void) mask;
+    queueChange(hloop->state, fd, 0);
     return 0;
 }
 
 static int removeEvent(struct snHopLoop *hloop, int fd, int delmask) {
     snApiState *state = hloop->state;
-    struct epoll_event ee;
-    int mask = hloop->events[fd].mask & (~delmask);
-
-    ee.events = 0;
-    if (mask & SN_READABLE) ee.events |= EPOLLIN;
-    if (mask & SN_WRITABLE) ee.events |= EPOLLOUT;
-    ee.data.u64 = 0; /* avoid valgrind warning */
-    ee.data.fd = fd;
-    if (mask != SN_NONE) {
-        epoll_ctl(state->epfd,EPOLL_CTL_MOD,fd,&ee);
-    } else {
-        /* Note, Kernel < 2.6.9 requires a non null event pointer even for
-         * EPOLL_CTL_DEL. */
-        epoll_ctl(state->epfd,EPOLL_CTL_DEL,fd,&ee);
-    }
+    (void) delmask;
     
+    /* hloop->events[fd].mask is already updated */
+    if (!(hloop->events[fd].mask & SN_POLLED) && state->fds[fd].registered) {
+        controlEvent(state, EPOLL_CTL_DEL, fd, 0);
+        state->fds[fd].registered = 0;
+    }
+    queueChange(state, fd, 0);
     return 0;
 }
 
-static int setTimeout(struct snHopLoop *hloop, struct timeval *tvp) {
+static int rearmEvent(struct snHopLoop *hloop, int fd) {
+    queueChange(hloop->state, fd, SN_EP_REARM);
+    return 0;
+}
+
+/** Tells epoll what the fd wants now. Returns -1 if it failed.
+ **/
+static int applyChange(snHopLoop *hloop, int fd) {
     snApiState *state = hloop->state;
-    int fd = timerfd_create(CLOCK_MONOTONIC, 0);
-    if (fd == -1) return -1;
-    struct itimerspec new_val;
+    snEpollFd *efd = &state->fds[fd];
+    int mask = hloop->events[fd].mask;
+    uint32_t wanted = (mask & SN_POLLED) ? getEpollEvents(mask) : 0;
+    int flags = efd->flags;
+    int retval = 0;
     
-    new_val.it_interval.tv_sec = 0;
-    new_val.it_interval.tv_nsec = 0;
-    new_val.it_value.tv_sec = tvp->tv_sec;
-    new_val.it_value.tv_nsec = tvp->tv_usec * 1000;
+    efd->flags = 0;
+    if (wanted == 0) return 0; /* deleted by removeEvent already */
     
-    if (timerfd_settime(fd, 0, &new_val, NULL) == -1) return -1;
+    /* MOD fails with ENOENT and ADD with EEXIST, if the fd was closed and
+     * its number reused behind our back, while it was listened to */
+    if (efd->registered == 0) {
+        retval = controlEvent(state, EPOLL_CTL_ADD, fd, wanted);
+        if (retval == -1 && errno == EEXIST) {
+            retval = controlEvent(state, EPOLL_CTL_MOD, fd, wanted);
+        }
+    } else if (efd->registered != wanted || (flags & SN_EP_REARM)) {
+        retval = controlEvent(state, EPOLL_CTL_MOD, fd, wanted);
+        if (retval == -1 && errno == ENOENT) {
+            retval = controlEvent(state, EPOLL_CTL_ADD, fd, wanted);
+        }
+    }
     
-    struct epoll_event ee;
-    int op = EPOLL_CTL_ADD;
+    efd->registered = retval == -1 ? 0 : wanted;
+    return retval;
+}
+
+/** Applies the changelist. A listener, which could not be added, fires
+ * once, so that its callback sees the error on its next read or write.
+ * Returns the number of such events put in hloop->fired.
+ **/
+static int flushChanges(snHopLoop *hloop) {
+    snApiState *state = hloop->state;
+    int i, nfailed = 0;
     
-    ee.events = 0;
-    ee.events |= EPOLLIN;
-    ee.data.u64 = 0; /* avoid valgrind warning */
-    ee.data.fd = fd;
-    if (epoll_ctl(state->epfd,op,fd,&ee) == -1) return -1;
+    for (i = 0; i < state->nchanges; i++) {
+        int fd = state->changes[i];
+        if (applyChange(hloop, fd) == 0) continue;
+        
+        hloop->fired[nfailed].fd = fd;
+        hloop->fired[nfailed].mask = hloop->events[fd].mask & (SN_READABLE | SN_WRITABLE);
+        nfailed++;
+    }
+    state->nchanges = 0;
+    
+    return nfailed;
+}
+
+/** Converts timeval to wheel ticks, rounding up to a full millisecond.
+ **/
+static int64_t toTicks(struct timeval *tvp) {
+    return (int64_t) tvp->tv_sec * 1000 + (tvp->tv_usec + 999) / 1000;
+}
+
+static int setTimeout(struct snHopLoop *hloop, struct timeval *tvp, int slack) {
+    snApiState *state = hloop->state;
+    return snWheelAdd(&state->wheel, getArmTick() + toTicks(tvp), 0, slack);
+}
+
+static int setInterval(struct snHopLoop *hloop, struct timeval *tvp, int slack) {
+    snApiState *state = hloop->state;
+    int64_t interval = toTicks(tvp);
+    if (interval < 1) interval = 1;
     
-    return fd;
+    return snWheelAdd(&state->wheel, getArmTick() + interval, interval, slack);
 }
 
-static int setInterval(struct snHopLoop *hloop, struct timeval *tvp) {
+static int clearTimer(struct snHopLoop *hloop, int fd) {
     snApiState *state = hloop->state;
-    int fd = timerfd_create(CLOCK_MONOTONIC, 0);
-    if (fd == -1) return -1;
-    struct itimerspec new_val;
+    return snWheelRemove(&state->wheel, fd);
+}
+
+typedef struct snExpired {
+    snHopLoop *hloop;
+    snTimerWheel *wheel;
+    int numevents;
+} snExpired;
+
+/* snWheelCallback; appends the expired timer to hloop->fired */
+static void addFiredTimer(void *udata, int id) {
+    snExpired *exp = udata;
+    snHopLoop *hloop = exp->hloop;
+    int mask = SN_TIMER;
     
-    new_val.it_interval.tv_sec = tvp->tv_sec;
-    new_val.it_interval.tv_nsec = tvp->tv_usec * 1000;
-    new_val.it_value.tv_sec = tvp->tv_sec;
-    new_val.it_value.tv_nsec = tvp->tv_usec * 1000;
+    if (exp->wheel->nodes[id].interval == 0) mask |= SN_ONCE;
+    hloop->fired[exp->numevents].fd = id;
+    hloop->fired[exp->numevents].mask = mask;
+    exp->numevents++;
+}
+
+/** Returns the time to wait in a poll in nanoseconds, or -1 for no limit:
+ * the timeout 'tsp' (NULL for none), shortened so that the poll returns when
+ * the nearest timer is due.
+ **/
+static int64_t getWaitNanos(snTimerWheel *wheel, struct timespec *tsp) {
+    int64_t wait = tsp ? (int64_t) tsp->tv_sec * 1000000000LL + tsp->tv_nsec : -1;
+    int64_t next = snWheelNext(wheel);
     
-    if (timerfd_settime(fd, 0, &new_val, NULL) == -1) return -1;
+    if (next != -1) {
+        /* tick 'next' begins at next * 1 ms */
+        int64_t due = next * 1000000LL - (int64_t) snNanoTime();
+        if (due < 0) due = 0;
+        if (wait == -1 || due < wait) wait = due;
+    }
     
-    struct epoll_event ee;
-    int op = EPOLL_CTL_ADD;
+    return wait;
+}
+
+/** Appends the expired timers to hloop->fired, after 'numevents' file events.
+ * Returns the new number of fired events.
+ **/
+static int expireTimers(snHopLoop *hloop, snTimerWheel *wheel, int numevents) {
+    /* every scheduled timer may expire at once; make room for all of them
+     * first, otherwise leave the timers for the next poll */
+    if (wheel->count == 0) return numevents;
+    if (growFired(hloop, numevents + wheel->count) == -1) return numevents;
     
-    ee.events = 0;
-    ee.events |= EPOLLIN;
-    ee.data.u64 = 0; /* avoid valgrind warning */
-    ee.data.fd = fd;
-    if (epoll_ctl(state->epfd,op,fd,&ee) == -1) return -1;
+    snExpired exp = { hloop, wheel, numevents };
+    snWheelExpire(wheel, getTick(), addFiredTimer, &exp);
+    hloop->stats.timersAligned += wheel->aligned;
+    wheel->aligned = 0;
     
-    return fd;
+    return exp.numevents;
 }
 
-static int clearTimer(struct snHopLoop *hloop, int fd) {
-    close(fd);
+/** epoll_wait with a nanosecond timeout ('wait', -1 for none). Without
+ * epoll_pwait2, the timeout is rounded up to a millisecond, so short waits
+ * don't turn into busy polling.
+ **/
+static int waitEvents(snApiState *state, int maxevents, int64_t wait) {
+#ifdef HAVE_EPOLL_PWAIT2
+    if (wait > 0 && wait % 1000000 != 0 && !state->nopwait2) {
+        struct timespec ts;
+        ts.tv_sec = wait / 1000000000LL;
+        ts.tv_nsec = wait % 1000000000LL;
+        
+        int retval = epoll_pwait2(state->epfd, state->events, maxevents, &ts, NULL);
+        if (retval != -1 || errno != ENOSYS) return retval;
+        state->nopwait2 = 1; /* kernel older than 5.11 */
+    }
+#endif
+    int64_t timeout = wait == -1 ? -1 : (wait + 999999) / 1000000;
+    if (timeout > INT_MAX) timeout = INT_MAX;
     
-    return 0;
+    return epoll_wait(state->epfd, state->events, maxevents, (int) timeout);
 }
 
-static int poll(struct snHopLoop *hloop, struct timeval *tvp) {
+static int poll(struct snHopLoop *hloop, struct timespec *tsp) {
     snApiState *state = hloop->state;
     int retval, numevents = 0;
-
-    retval = epoll_wait(state->epfd,state->events,SN_SETSIZE,
-            tvp ? (tvp->tv_sec*1000 + tvp->tv_usec/1000) : -1);
+    
+    /* fired has hloop->setsize slots, which is enough for the failed ones
+     * (each fd is on the changelist once), but not for them and epoll's */
+    int nfailed = flushChanges(hloop);
+    int maxevents = hloop->setsize - nfailed;
+    
+    int64_t wait = nfailed > 0 ? 0 : getWaitNanos(&state->wheel, tsp);
+    retval = maxevents > 0 ? waitEvents(state, maxevents, wait) : 0;
+    numevents = nfailed;
     if (retval > 0) {
         int j;
 
-        numevents = retval;
-        for (j = 0; j < numevents; j++) {
+        for (j = 0; j < retval; j++) {
             int mask = 0;
             struct epoll_event *e = state->events+j;
-
-            if (e->events & EPOLLIN) {
-                mask |= SN_READABLE;
-                if (hloop->timers[e->data.fd].mask & SN_TIMER) {
-                    mask |= SN_TIMER;
-                    read(e->data.fd, NULL, 8);
-                }
-                if (hloop->timers[e->data.fd].mask & SN_ONCE) mask |= SN_ONCE;
-            }
+            int fd = e->data.fd;
+            
+            if (e->events & EPOLLIN) mask |= SN_READABLE;
             if (e->events & EPOLLOUT) mask |= SN_WRITABLE;
-            hloop->fired[j].fd = e->data.fd;
-            hloop->fired[j].mask = mask;
+            hloop->fired[numevents].fd = fd;
+            hloop->fired[numevents].mask = mask;
+            numevents++;
         }
     }
     
-    return numevents;
+    return expireTimers(hloop, &state->wheel, numevents);
 }
+
+#ifdef HAVE_IO_URING
+    #include "uring_hop.c"
+#endif
@@ -33,15 +33,35 @@
 #define __SN_HOPLOOP__
 
 #include <sys/time.h>
+#include <time.h>
 #include <lua.h>
+#include "cluster.h"
+#include "stats.h"
+#include "inbox.h"
+#include "pool.h"
+#include "buffer.h"
 
-#define SN_SETSIZE (1024*10)    /* Max number of fd supported */
+#define SN_INITSETSIZE 64   /* Initial number of slots; tables grow on demand */
 
 #define SN_NONE 0
 #define SN_READABLE 1
 #define SN_WRITABLE 2
 #define SN_TIMER 4
 #define SN_ONCE 8
+#define SN_EDGE 16 /* edge-triggered listener */
+#define SN_ONESHOT 32 /* listener disabled after each event, until re-armed */
+#define SN_EXCLUSIVE 64 /* only one of the loops sharing the fd is woken up */
+#define SN_WQUEUE 128 /* the write queue waits for the fd to become writable */
+#define SN_RWAIT 256 /* rcallback is a coroutine suspended in loop:wait */
+#define SN_WWAIT 512 /* wcallback is a coroutine suspended in loop:wait */
+#define SN_SLEEP 1024 /* the timer callback is a coroutine suspended in loop:sleep */
+#define SN_NATIVE 2048 /* events of the fd go to the C handler in its snFileExt */
+#define SN_HIGH 4096 /* dispatched before other fds and timers */
+#define SN_LOW 8192 /* dispatched after other fds and timers */
+#define SN_FFI 16384 /* events of the fd go to luahop_ffi_poll (see luahop_ffi.h) */
+
+#define SN_WANTWRITE (SN_WRITABLE | SN_WQUEUE) /* reasons to poll for writability */
+#define SN_POLLED (SN_READABLE | SN_WANTWRITE) /* reasons to poll the fd at all */
 
 struct snHopLoop;
 
@@ -51,12 +71,70 @@ typedef struct snFiredEvent {
 } snFiredEvent;
 
 typedef struct snFileEvent {
-    lua_State *L;
-    int rcallback; //read callback - fn reference
-    int wcallback; //write callback
     int mask;
+    int rcallback; //read callback - fn (or coroutine) reference; LUA_NOREF if none
+    int wcallback; //write callback
+    int carried; /* index in hloop->carry + 1; 0 if not carried over */
+    unsigned long long deadline; /* snNanoTime of loop:setdeadline; 0 if none */
+    lua_State *L;
 } snFileEvent;
 
+/* A string waiting in the write queue; the Lua string is kept alive
+ * by a reference, so its bytes are not copied. */
+typedef struct snWriteChunk {
+    const char *data;
+    size_t len;
+    int ref;
+} snWriteChunk;
+
+struct snHopLoop;
+
+/* Handles the events of an SN_NATIVE fd, instead of a Lua callback */
+typedef void (*snNativeHandler)(lua_State *L, struct snHopLoop *hloop, int fd, int mask);
+
+/* Rarely used per-fd data; allocated only for fds which need it */
+typedef struct snFileExt {
+    lua_State *L;
+    snNativeHandler handler;
+    snWriteChunk *chunks; /* Ring of queued chunks */
+    int head;
+    int count;
+    int capacity;
+    size_t queued; /* Bytes in the write queue */
+    size_t high; /* Watermarks; 0 means not set */
+    size_t low;
+    size_t max; /* Writes which would queue more than that fail; 0 means no limit */
+    int drain; /* Callback fired when the queue shrinks to the low watermark */
+    int highwater; /* Callback fired when the queue grows over the high watermark */
+    int sending; /* A loop:sendfile is in progress */
+    int sendfd; /* File being sent */
+    int sendahead; /* Queued chunks which go out before the file */
+    off_t sendoffset;
+    size_t sendleft; /* Bytes of the file still to send */
+    size_t sent;
+    int sendcallback; /* Fired when the file is sent, or on errors */
+    void (*nativefn)(struct snHopLoop *hloop, int fd, int mask, void *udata); /* native_add of luahop.h */
+    void *nativedata;
+    unsigned long long dltimeout; /* loop:setdeadline timeout in ns, renewed by loop:touch */
+    int dlcallback;
+    int dlslot; /* Deadline bucket of the fd, and its neighbours there (-1 if none) */
+    int dlnext;
+    int dlprev;
+    int acceptmax; /* Connections a loop:acceptor takes per iteration */
+    int acceptopts; /* SN_ACCEPT_* flags */
+    char *dgrams; /* Addresses and buffers for dgrammax datagrams of a loop:datagram */
+    int dgrammax;
+    int dgramsize;
+} snFileExt;
+
+/* Callback references run by the loop itself: deferred functions and hooks */
+typedef struct snCallbackList {
+    int *refs; /* LUA_NOREF marks a removed entry */
+    int count;
+    int size;
+    int removed; /* entries marked as removed */
+} snCallbackList;
+
 typedef struct snTimerEvent {
     lua_State *L;
     int callback;
@@ -65,12 +143,15 @@ typedef struct snTimerEvent {
 
 typedef struct snLoopApi {
     /* methods */
+    int (*closeLoop)(struct snHopLoop *);
+    int (*resize)(struct snHopLoop *, int setsize);
     int (*addEvent)(struct snHopLoop *, int fd, int mask);
     int (*removeEvent)(struct snHopLoop*, int fd, int mask);
-    int (*poll)(struct snHopLoop*, struct timeval *tvp);
+    int (*rearmEvent)(struct snHopLoop*, int fd);
+    int (*poll)(struct snHopLoop*, struct timespec *tsp); /* NULL waits forever */
     
-    int (*setTimeout)(struct snHopLoop *hloop, struct timeval *tvp);
-    int (*setInterval)(struct snHopLoop *hloop, struct timeval *tvp);
+    int (*setTimeout)(struct snHopLoop *hloop, struct timeval *tvp, int slack);
+    int (*setInterval)(struct snHopLoop *hloop, struct timeval *tvp, int slack);
     int (*clearTimer)(struct snHopLoop *hloop, int fd);
     
     /* fields */
@@ -80,19 +161,56 @@ typedef struct snLoopApi {
 typedef struct snHopLoop {
     snLoopApi *api;
     void *state;
-    snFileEvent events[SN_SETSIZE]; /* Registered file events */
-    snTimerEvent timers[SN_SETSIZE];
-    snFiredEvent fired[SN_SETSIZE]; /* Fired events */
+    snFileEvent *events; /* Registered file events, indexed by fd */
+    snTimerEvent *timers; /* Registered timers, indexed by timer id */
+    snFiredEvent *fired; /* Fired events */
+    snFileExt **exts; /* Rarely used per-fd data, indexed by fd; NULL if unused */
+    int setsize; /* Number of slots in events */
+    int timersize; /* Number of slots in timers */
+    int firedsize; /* Number of slots in fired */
+    snWorkerStats *worker; /* Counters of the cluster worker; NULL outside clusters */
+    snLoopStats stats;
+    snCallbackList deferred; /* FIFO of loop:defer functions */
+    snCallbackList idle; /* Hooks run before each poll, which doesn't block then */
+    snCallbackList prepare; /* Hooks run before each poll */
+    snCallbackList check; /* Hooks run after the events of each poll */
+    struct snSignals *signals; /* loop:onsignal watchers; NULL until used */
+    snInbox *inbox; /* loop:inbox; NULL until used */
+    int inboxcallback;
+    snPool *pool; /* Worker threads for blocking jobs; NULL until used */
+    int poolthreads; /* loop:pool settings; 0 means the default */
+    int pooldepth;
+    snBufferPool *buffers; /* Slabs of loop:buffer; NULL until used */
+    int slack; /* Default timer slack in milliseconds; see loop:slack */
+    unsigned long long now; /* snNanoTime after the last poll; see loop:now */
+    snFiredEvent *carry; /* File events left for the next iteration by the budget */
+    int ncarry;
+    int carrysize;
+    int prioritized; /* +high or +low listeners were set */
+    int natives; /* native_add of luahop.h was used */
+    int budgetCallbacks; /* loop:budget limits; 0 means no limit */
+    int budgetUsec;
+    int ffipending; /* Events left by luahop_ffi_poll at the start of fired */
+    int *deadlines; /* Heads of the deadline buckets; NULL until used */
+    int ndeadlines;
+    unsigned long long dltick; /* No bucket before this tick has deadlines */
     int shouldStop;
 } snHopLoop;
 
+/* implemented in main.c; backends use them to make room for new ids */
+static int growEvents(struct snHopLoop *hloop, int fd);
+static int growTimers(struct snHopLoop *hloop, int id);
+static int growFired(struct snHopLoop *hloop, int n);
+
 static int init(struct snHopLoop *);
 static int closeLoop(struct snHopLoop *);
+static int resize(struct snHopLoop *, int setsize);
 static int addEvent(struct snHopLoop *hloop, int fd, int mask);
 static int removeEvent(struct snHopLoop *, int fd, int mask);
-static int poll(struct snHopLoop *, struct timeval *tvp);
-static int setTimeout(struct snHopLoop *hloop, struct timeval *tvp);
-static int setInterval(struct snHopLoop *hloop, struct timeval *tvp);
+static int rearmEvent(struct snHopLoop *, int fd);
+static int poll(struct snHopLoop *, struct timespec *tsp);
+static int setTimeout(struct snHopLoop *hloop, struct timeval *tvp, int slack);
+static int setInterval(struct snHopLoop *hloop, struct timeval *tvp, int slack);
 static int clearTimer(struct snHopLoop *hloop, int fd);
 
 #endif
\ No newline at end of file
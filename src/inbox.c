@@ -0,0 +1,499 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "inbox.h"
+
+#define checkInbox(L) (snInbox **)luaL_checkudata(L, 1, "pl.makenika.hopinbox")
+
+/* Message encoding: a type byte, followed by the value.
+ * Tables are flat: a count of pairs, followed by keys and values. */
+#define SN_MSG_FALSE 1
+#define SN_MSG_TRUE 2
+#define SN_MSG_NUMBER 3 /* lua_Number */
+#define SN_MSG_STRING 4 /* size_t length, bytes */
+#define SN_MSG_TABLE 5 /* uint32_t count, count * (key, value) */
+
+typedef struct snMessage {
+    size_t len;
+    char data[1];
+} snMessage;
+
+typedef struct snInboxCell {
+    size_t seq;
+    snMessage *msg;
+} snInboxCell;
+
+struct snInbox {
+    char *name;
+    struct snInbox *next; /* in the list of open inboxes */
+    int refs; /* the loop and every producer handle hold one */
+    int closed; /* set once the loop is gone */
+    int rfd; /* eventfd (or the read end of a pipe) */
+    int wfd;
+    int signaled; /* the loop has a wakeup pending */
+    size_t head; /* consumer only */
+    size_t tail;
+    size_t mask;
+    snInboxCell *cells;
+};
+
+static pthread_mutex_t inboxes_lock = PTHREAD_MUTEX_INITIALIZER;
+static snInbox *inboxes = NULL;
+
+static snInbox *findInbox(const char *name) {
+    snInbox *inbox = inboxes;
+    while (inbox && strcmp(inbox->name, name) != 0) inbox = inbox->next;
+    
+    return inbox;
+}
+
+static int openWakeup(snInbox *inbox) {
+#ifdef __linux__
+    inbox->rfd = inbox->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return inbox->rfd;
+#else
+    int fds[2];
+    if (pipe(fds) == -1) return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    inbox->rfd = fds[0];
+    inbox->wfd = fds[1];
+    return 0;
+#endif
+}
+
+static void destroyInbox(snInbox *inbox) {
+    snMessage *msg;
+    
+    while (inbox->head != inbox->tail) {
+        msg = inbox->cells[inbox->head & inbox->mask].msg;
+        if (inbox->cells[inbox->head & inbox->mask].seq == inbox->head + 1) free(msg);
+        inbox->head++;
+    }
+    close(inbox->rfd);
+    if (inbox->wfd != inbox->rfd) close(inbox->wfd);
+    free(inbox->cells);
+    free(inbox->name);
+    free(inbox);
+}
+
+/** Creates an inbox named 'name' for a loop. Returns NULL if the name is
+ * taken or on errors. 'capacity' is rounded up to a power of two.
+ **/
+snInbox *snInboxCreate(const char *name, int capacity) {
+    size_t i, size = 2;
+    
+    while (size < (size_t) capacity) size *= 2;
+    
+    snInbox *inbox = calloc(1, sizeof(snInbox));
+    if (!inbox) return NULL;
+    inbox->name = strdup(name);
+    inbox->cells = malloc(sizeof(snInboxCell) * size);
+    if (!inbox->name || !inbox->cells || openWakeup(inbox) == -1) {
+        free(inbox->name);
+        free(inbox->cells);
+        free(inbox);
+        return NULL;
+    }
+    for (i = 0; i < size; i++) inbox->cells[i].seq = i;
+    inbox->mask = size - 1;
+    inbox->refs = 1;
+    
+    pthread_mutex_lock(&inboxes_lock);
+    if (findInbox(name)) {
+        pthread_mutex_unlock(&inboxes_lock);
+        destroyInbox(inbox);
+        return NULL;
+    }
+    inbox->next = inboxes;
+    inboxes = inbox;
+    pthread_mutex_unlock(&inboxes_lock);
+    
+    return inbox;
+}
+
+/** Returns the inbox named 'name' with a new reference, or NULL.
+ **/
+snInbox *snInboxOpen(const char *name) {
+    pthread_mutex_lock(&inboxes_lock);
+    snInbox *inbox = findInbox(name);
+    if (inbox) __atomic_add_fetch(&inbox->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&inboxes_lock);
+    
+    return inbox;
+}
+
+void snInboxRelease(snInbox *inbox) {
+    if (__atomic_sub_fetch(&inbox->refs, 1, __ATOMIC_ACQ_REL) == 0) destroyInbox(inbox);
+}
+
+/** Called by the loop, when it's gone. Posting fails from now on.
+ **/
+void snInboxClose(snInbox *inbox) {
+    snInbox **p;
+    
+    pthread_mutex_lock(&inboxes_lock);
+    for (p = &inboxes; *p; p = &(*p)->next) {
+        if (*p == inbox) {
+            *p = inbox->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&inboxes_lock);
+    
+    __atomic_store_n(&inbox->closed, 1, __ATOMIC_RELEASE);
+    snInboxRelease(inbox);
+}
+
+int snInboxFd(snInbox *inbox) {
+    return inbox->rfd;
+}
+
+/** Posts a message, which the inbox owns from now on; any thread may call
+ * it. Returns 0, or -1 with errno set to EAGAIN (the inbox is full) or EPIPE
+ * (it's closed); the message is freed then.
+ **/
+static int postMessage(snInbox *inbox, snMessage *msg) {
+    if (__atomic_load_n(&inbox->closed, __ATOMIC_ACQUIRE)) {
+        free(msg);
+        errno = EPIPE;
+        return -1;
+    }
+    
+    /* bounded MPMC queue by Dmitry Vyukov, with a single consumer */
+    size_t pos = __atomic_load_n(&inbox->tail, __ATOMIC_RELAXED);
+    snInboxCell *cell;
+    for (;;) {
+        cell = &inbox->cells[pos & inbox->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+        
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&inbox->tail, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (dif < 0) {
+            free(msg);
+            errno = EAGAIN;
+            return -1;
+        } else {
+            pos = __atomic_load_n(&inbox->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->msg = msg;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    
+    /* one wakeup per batch: the loop clears 'signaled' before draining */
+    if (__atomic_exchange_n(&inbox->signaled, 1, __ATOMIC_SEQ_CST) == 0) {
+#ifdef __linux__
+        uint64_t one = 1;
+        if (write(inbox->wfd, &one, sizeof(one))) {}
+#else
+        if (write(inbox->wfd, "", 1)) {}
+#endif
+    }
+    
+    return 0;
+}
+
+/* Growing buffer of an snMessage being encoded */
+typedef struct snEncoder {
+    snMessage *msg;
+    size_t size; /* bytes allocated for msg->data */
+} snEncoder;
+
+static int putBytes(snEncoder *enc, const void *data, size_t len) {
+    size_t used = enc->msg ? enc->msg->len : 0;
+    
+    if (!enc->msg || used + len > enc->size) {
+        size_t size = enc->size ? enc->size : 64;
+        while (size < used + len) size *= 2;
+        snMessage *msg = realloc(enc->msg, sizeof(snMessage) + size);
+        if (!msg) return -1;
+        msg->len = used;
+        enc->msg = msg;
+        enc->size = size;
+    }
+    memcpy(enc->msg->data + used, data, len);
+    enc->msg->len += len;
+    
+    return 0;
+}
+
+/** Posts a string message; for native producers.
+ **/
+int snInboxPost(snInbox *inbox, const char *data, size_t len) {
+    snEncoder enc = {NULL, 0};
+    char type = SN_MSG_STRING;
+    
+    if (putBytes(&enc, &type, 1) == -1 || putBytes(&enc, &len, sizeof(len)) == -1 ||
+        putBytes(&enc, data, len) == -1) {
+        free(enc.msg);
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    return postMessage(inbox, enc.msg);
+}
+
+/** Encodes the value at 'idx', which has to be a boolean, a number or a
+ * string. Returns 0, -1 if the value can't be posted or -2 on ENOMEM.
+ **/
+static int encodeValue(lua_State *L, int idx, snEncoder *enc) {
+    char type;
+    int retval;
+    
+    switch (lua_type(L, idx)) {
+        case LUA_TBOOLEAN:
+            type = lua_toboolean(L, idx) ? SN_MSG_TRUE : SN_MSG_FALSE;
+            retval = putBytes(enc, &type, 1);
+            break;
+        case LUA_TNUMBER: {
+            lua_Number n = lua_tonumber(L, idx);
+            type = SN_MSG_NUMBER;
+            retval = putBytes(enc, &type, 1) | putBytes(enc, &n, sizeof(n));
+            break;
+        }
+        case LUA_TSTRING: {
+            size_t len;
+            const char *s = lua_tolstring(L, idx, &len);
+            type = SN_MSG_STRING;
+            retval = putBytes(enc, &type, 1) | putBytes(enc, &len, sizeof(len)) |
+                     putBytes(enc, s, len);
+            break;
+        }
+        default:
+            return -1;
+    }
+    
+    return retval ? -2 : 0;
+}
+
+/** Encodes the value at 'idx' (a primitive or a flat table).
+ * Returns 0, -1 if the value can't be posted or -2 on ENOMEM.
+ **/
+static int encodeMessage(lua_State *L, int idx, snEncoder *enc) {
+    if (lua_type(L, idx) != LUA_TTABLE) return encodeValue(L, idx, enc);
+    
+    char type = SN_MSG_TABLE;
+    uint32_t count = 0;
+    if (putBytes(enc, &type, 1) == -1 || putBytes(enc, &count, sizeof(count)) == -1) {
+        return -2;
+    }
+    
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        int retval = encodeValue(L, -2, enc);
+        if (retval == 0) retval = encodeValue(L, -1, enc);
+        if (retval != 0) {
+            lua_pop(L, 2);
+            return retval;
+        }
+        lua_pop(L, 1);
+        count++;
+    }
+    memcpy(enc->msg->data + 1, &count, sizeof(count));
+    
+    return 0;
+}
+
+/** Decodes a value at 'p' (with 'end' as its limit) and pushes it.
+ * Returns the position after it, or NULL if the data is broken.
+ **/
+static const char *decodeValue(lua_State *L, const char *p, const char *end) {
+    if (p >= end) return NULL;
+    
+    switch (*p++) {
+        case SN_MSG_FALSE: lua_pushboolean(L, 0); return p;
+        case SN_MSG_TRUE: lua_pushboolean(L, 1); return p;
+        case SN_MSG_NUMBER: {
+            lua_Number n;
+            if (end - p < (ptrdiff_t) sizeof(n)) return NULL;
+            memcpy(&n, p, sizeof(n));
+            lua_pushnumber(L, n);
+            return p + sizeof(n);
+        }
+        case SN_MSG_STRING: {
+            size_t len;
+            if (end - p < (ptrdiff_t) sizeof(len)) return NULL;
+            memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            if ((size_t) (end - p) < len) return NULL;
+            lua_pushlstring(L, p, len);
+            return p + len;
+        }
+        case SN_MSG_TABLE: {
+            uint32_t i, count;
+            if (end - p < (ptrdiff_t) sizeof(count)) return NULL;
+            memcpy(&count, p, sizeof(count));
+            p += sizeof(count);
+            lua_createtable(L, 0, 0);
+            for (i = 0; i < count && p; i++) {
+                p = decodeValue(L, p, end);
+                if (p) p = decodeValue(L, p, end);
+                if (p) lua_rawset(L, -3);
+            }
+            return p;
+        }
+        default:
+            return NULL;
+    }
+}
+
+/** Pushes an array of the messages waiting in the inbox (at most its
+ * capacity, so producers can't keep the loop busy forever). Returns their
+ * number. Only the loop which created the inbox may call it.
+ **/
+int snInboxDrain(lua_State *L, snInbox *inbox) {
+    char buf[64];
+    int count = 0;
+    
+    /* clear the wakeup first, so that a message posted while draining
+     * signals the loop again */
+    while (read(inbox->rfd, buf, sizeof(buf)) > 0) {}
+    __atomic_store_n(&inbox->signaled, 0, __ATOMIC_SEQ_CST);
+    
+    lua_newtable(L);
+    while ((size_t) count <= inbox->mask) {
+        snInboxCell *cell = &inbox->cells[inbox->head & inbox->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        if (seq != inbox->head + 1) break; /* empty */
+        
+        snMessage *msg = cell->msg;
+        __atomic_store_n(&cell->seq, inbox->head + inbox->mask + 1, __ATOMIC_RELEASE);
+        inbox->head++;
+        
+        if (decodeValue(L, msg->data, msg->data + msg->len)) {
+            lua_rawseti(L, -2, ++count);
+        }
+        free(msg);
+    }
+    
+    return count;
+}
+
+/** Pushes a producer handle of 'inbox', which takes a new reference.
+ **/
+void snPushInbox(lua_State *L, snInbox *inbox) {
+    snInbox **handle = lua_newuserdata(L, sizeof(snInbox *));
+    __atomic_add_fetch(&inbox->refs, 1, __ATOMIC_RELAXED);
+    *handle = inbox;
+    luaL_getmetatable(L, "pl.makenika.hopinbox");
+    lua_setmetatable(L, -2);
+}
+
+/** luahop.inbox(name)
+ * Opens the inbox of a loop (made with loop:inbox(name, fn)) for posting.
+ **/
+static int hop_inbox(lua_State *L) {
+    snInbox *inbox = snInboxOpen(luaL_checkstring(L, 1));
+    if (!inbox) {
+        lua_pushnil(L);
+        lua_pushstring(L, "No such inbox.");
+        return 2;
+    }
+    
+    snPushInbox(L, inbox);
+    snInboxRelease(inbox);
+    
+    return 1;
+}
+
+/** inbox:post(value)
+ * Returns true, or false and "full", "closed" or an error message.
+ **/
+static int inbox_post(lua_State *L) {
+    snInbox **handle = checkInbox(L);
+    luaL_checkany(L, 2);
+    lua_settop(L, 2);
+    
+    if (!*handle) return luaL_error(L, "The inbox handle is closed.");
+    
+    snEncoder enc = {NULL, 0};
+    int retval = encodeMessage(L, 2, &enc);
+    if (retval != 0) {
+        free(enc.msg);
+        if (retval == -2) return luaL_error(L, "Out of memory.");
+        return luaL_error(L, "Only strings, numbers, booleans and flat tables can be posted.");
+    }
+    
+    if (postMessage(*handle, enc.msg) == 0) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    
+    lua_pushboolean(L, 0);
+    if (errno == EAGAIN) lua_pushliteral(L, "full");
+    else if (errno == EPIPE) lua_pushliteral(L, "closed");
+    else lua_pushstring(L, strerror(errno));
+    
+    return 2;
+}
+
+static int inbox_gc(lua_State *L) {
+    snInbox **handle = checkInbox(L);
+    
+    if (*handle) snInboxRelease(*handle);
+    *handle = NULL;
+    
+    return 0;
+}
+
+static int inbox_repr(lua_State *L) {
+    snInbox **handle = checkInbox(L);
+    lua_pushfstring(L, "<Hop Inbox: %s>", *handle ? (*handle)->name : "closed");
+    
+    return 1;
+}
+
+static const struct luaL_Reg inboxlib_m [] = {
+    {"post", inbox_post},
+    {"close", inbox_gc},
+    {"__tostring", inbox_repr},
+    {"__gc", inbox_gc},
+    {NULL, NULL}
+};
+
+int snOpenInbox(lua_State *L) {
+    luaL_newmetatable(L, "pl.makenika.hopinbox");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_register(L, NULL, inboxlib_m);
+    lua_pop(L, 1);
+    
+    lua_pushcfunction(L, hop_inbox);
+    lua_setfield(L, -2, "inbox");
+    
+    return 0;
+}
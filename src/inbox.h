@@ -0,0 +1,48 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Cross-thread inbox of a loop: a bounded lock-free ring with many
+ * producers (any thread) and one consumer (the loop), plus an eventfd which
+ * wakes the loop up once per batch of messages. Inboxes have process-wide
+ * names, so other Lua states (e.g. cluster workers) and native threads can
+ * open them. Messages are strings, numbers, booleans or flat tables. */
+
+#ifndef __SN_INBOX__
+#define __SN_INBOX__
+
+#include <stddef.h>
+#include <lua.h>
+
+#define SN_INBOX_CAPACITY 1024 /* Default number of messages an inbox holds */
+
+typedef struct snInbox snInbox;
+
+snInbox *snInboxCreate(const char *name, int capacity);
+snInbox *snInboxOpen(const char *name);
+void snInboxClose(snInbox *inbox);
+void snInboxRelease(snInbox *inbox);
+int snInboxFd(snInbox *inbox);
+int snInboxPost(snInbox *inbox, const char *data, size_t len);
+int snInboxDrain(lua_State *L, snInbox *inbox);
+void snPushInbox(lua_State *L, snInbox *inbox);
+int snOpenInbox(lua_State *L);
+
+#endif
@@ -31,6 +31,8 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
@@ -38,28 +40,43 @@
 
 typedef struct snApiState {
     int kqfd;
-    struct kevent events[SN_SETSIZE];
+    struct kevent *events; /* hloop->setsize slots */
 } snApiState;
 
-static snHopLoop *createLoop() {
-    snHopLoop *loop = malloc(sizeof(snHopLoop));
+static int createLoop(snHopLoop *hloop, const char *backend) {
+    if (backend && strcmp(backend, "kqueue") != 0) return -1;
+    
     snLoopApi *api = malloc(sizeof(snLoopApi));
     snApiState *state = malloc(sizeof(snApiState));
     
-    if (! (loop && api)) {
-        return NULL;
+    if (! (api && state)) {
+        free(api);
+        free(state);
+        return -1;
     }
     
-    loop->api = api;
-    loop->state = state;
+    state->events = NULL;
+    hloop->api = api;
+    hloop->state = state;
     
     api->name = "kqueue";
+    api->closeLoop = closeLoop;
+    api->resize = resize;
+    api->addEvent = addEvent;
+    api->removeEvent = removeEvent;
+    api->rearmEvent = rearmEvent;
+    api->poll = poll;
+    api->setTimeout = setTimeout;
+    api->setInterval = setInterval;
+    api->clearTimer = clearTimer;
     
-    if (init(loop) < 0) {
-        return NULL;
+    if (init(hloop) < 0) {
+        free(api);
+        free(state);
+        return -1;
     }
     
-    return loop;
+    return 0;
 }
 
 static int init(struct snHopLoop *hloop) {
@@ -75,21 +92,43 @@ static int init(struct snHopLoop *hloop) {
 static int closeLoop(struct snHopLoop *hloop) {
 	snApiState *state = hloop->state;
     close(state->kqfd);
+    free(state->events);
+    
+    return 0;
+}
+
+static int resize(struct snHopLoop *hloop, int setsize) {
+    snApiState *state = hloop->state;
+    struct kevent *events = realloc(state->events, sizeof(struct kevent) * setsize);
+    if (!events) return -1;
+    state->events = events;
     
     return 0;
 }
 
+/** Translates listener modifiers to kevent flags.
+ **/
+static int getKeventFlags(int mask) {
+    int flags = 0;
+    
+    if (mask & SN_EDGE) flags |= EV_CLEAR;
+    if (mask & SN_ONESHOT) flags |= EV_DISPATCH;
+    
+    return flags;
+}
+
 static int addEvent(struct snHopLoop *hloop, int fd, int mask) {
     snApiState *state = hloop->state;
     int kqfd = state->kqfd;
+    int flags = EV_ADD | getKeventFlags(mask | hloop->events[fd].mask);
     struct kevent ke;
     
     if (mask & SN_READABLE) {
-        EV_SET(&ke, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        EV_SET(&ke, fd, EVFILT_READ, flags, 0, 0, NULL);
         if (kevent(kqfd, &ke, 1, NULL, 0, NULL) == -1) return -1;
     }
-    if (mask & SN_WRITABLE) {
-        EV_SET(&ke, fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+    if (mask & SN_WANTWRITE) {
+        EV_SET(&ke, fd, EVFILT_WRITE, flags, 0, 0, NULL);
         if (kevent(kqfd, &ke, 1, NULL, 0, NULL) == -1) return -1;
     }
 
@@ -99,13 +138,15 @@ static int addEvent(struct snHopLoop *hloop, int fd, int mask) {
 static int removeEvent(struct snHopLoop *hloop, int fd, int mask) {
     snApiState *state = hloop->state;
     int kqfd = state->kqfd;
+    int left = hloop->events[fd].mask & (~mask);
     struct kevent ke;
 
-    if (mask & SN_READABLE) {
+    if ((mask & SN_READABLE) && !(left & SN_READABLE)) {
         EV_SET(&ke, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
         kevent(kqfd, &ke, 1, NULL, 0, NULL);
     }
-    if (mask & SN_WRITABLE) {
+    /* the write filter is shared by a "w" listener and the write queue */
+    if ((mask & SN_WANTWRITE) && !(left & SN_WANTWRITE)) {
         EV_SET(&ke, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
         kevent(kqfd, &ke, 1, NULL, 0, NULL);
     }
@@ -113,6 +154,25 @@ static int removeEvent(struct snHopLoop *hloop, int fd, int mask) {
     return 0;
 }
 
+static int rearmEvent(struct snHopLoop *hloop, int fd) {
+    snApiState *state = hloop->state;
+    int kqfd = state->kqfd;
+    int mask = hloop->events[fd].mask;
+    int flags = EV_ENABLE | getKeventFlags(mask);
+    struct kevent ke;
+    
+    if (mask & SN_READABLE) {
+        EV_SET(&ke, fd, EVFILT_READ, flags, 0, 0, NULL);
+        if (kevent(kqfd, &ke, 1, NULL, 0, NULL) == -1) return -1;
+    }
+    if (mask & SN_WANTWRITE) {
+        EV_SET(&ke, fd, EVFILT_WRITE, flags, 0, 0, NULL);
+        if (kevent(kqfd, &ke, 1, NULL, 0, NULL) == -1) return -1;
+    }
+    
+    return 0;
+}
+
 /* Timer has two types: timeouts and intervals (as in JavaScript) */
 static int setTimer(struct snHopLoop *hloop, int fd, struct timeval *tvp, int flags) {
     snApiState *state = hloop->state;
@@ -120,7 +180,7 @@ static int setTimer(struct snHopLoop *hloop, int fd, struct timeval *tvp, int fl
     struct kevent ke;
     
     if ((flags & EV_ADD) && tvp) { /* add timer */
-        long int millis = tvp->tv_sec * 1000 + tvp->tv_usec / 1000;
+        int64_t millis = (int64_t) tvp->tv_sec * 1000 + tvp->tv_usec / 1000;
         EV_SET(&ke, fd, EVFILT_TIMER, flags, 0, millis, NULL);
         kevent(kqfd, &ke, 1, NULL, 0, NULL);
     } else if (flags & EV_DELETE) { /* clear timer */
@@ -135,23 +195,33 @@ static int getFreeTimerId(struct snHopLoop *hloop) {
     int fd = -1;
     int i = 0;
     
-    for (i=0; i<SN_SETSIZE; i++) {
+    for (i=0; i<hloop->timersize; i++) {
         if (hloop->timers[i].mask == SN_NONE) {
             fd = i;
             break;
         };
     }
     
+    /* every slot is taken; make room for one more */
+    if (fd == -1 && growTimers(hloop, hloop->timersize) == 0) {
+        fd = i;
+    }
+    
     return fd;
 }
 
-static int setTimeout(struct snHopLoop *hloop, struct timeval *tvp) {
+/* kqueue timers are per-timer kernel objects; slack is ignored */
+static int setTimeout(struct snHopLoop *hloop, struct timeval *tvp, int slack) {
     int fd = getFreeTimerId(hloop);
+    (void) slack;
+    if (fd == -1) return -1;
     return setTimer(hloop, fd, tvp, EV_ADD|EV_ONESHOT);
 }
 
-static int setInterval(struct snHopLoop *hloop, struct timeval *tvp) {
+static int setInterval(struct snHopLoop *hloop, struct timeval *tvp, int slack) {
     int fd = getFreeTimerId(hloop);
+    (void) slack;
+    if (fd == -1) return -1;
     return setTimer(hloop, fd, tvp, EV_ADD);
 }
 
@@ -159,19 +229,12 @@ static int clearTimer(struct snHopLoop *hloop, int fd) {
     return setTimer(hloop, fd, NULL, EV_DELETE);
 }
 
-static int poll(struct snHopLoop *hloop, struct timeval *tvp) {
+static int poll(struct snHopLoop *hloop, struct timespec *tsp) {
     snApiState *state = hloop->state;
     int kqfd = state->kqfd;
     int retval, numevents = 0;
 
-    if (tvp != NULL) {
-        struct timespec timeout;
-        timeout.tv_sec = tvp->tv_sec;
-        timeout.tv_nsec = tvp->tv_usec * 1000;
-        retval = kevent(kqfd, NULL, 0, state->events, SN_SETSIZE, &timeout);
-    } else {
-        retval = kevent(kqfd, NULL, 0, state->events, SN_SETSIZE, NULL);
-    }    
+    retval = kevent(kqfd, NULL, 0, state->events, hloop->setsize, tsp);
 
     if (retval > 0) {
         int j;
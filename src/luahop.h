@@ -0,0 +1,85 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Public C API of luahop, for native modules loaded in the same process.
+ * Since luahop is a Lua module, its symbols aren't linked against: the API
+ * table is stored in the registry, when luahop is required.
+ *
+ *     const luahop_Api *api = luahop_getapi(L);
+ *     luahop_Inbox *inbox = api ? api->inbox_open("jobs") : NULL;
+ *
+ * The inbox functions may be called from any thread; the loop functions
+ * only from the thread running the loop. */
+
+#ifndef __LUAHOP_H__
+#define __LUAHOP_H__
+
+#include <stddef.h>
+#include <lua.h>
+
+#define LUAHOP_API_KEY "pl.makenika.luahop.api"
+#define LUAHOP_API_VERSION 2 /* 2 added the loop functions */
+
+#define LUAHOP_READABLE 1
+#define LUAHOP_WRITABLE 2
+
+typedef struct snInbox luahop_Inbox;
+typedef struct snHopLoop luahop_Loop;
+
+/* Handles the events ('mask' of LUAHOP_READABLE | LUAHOP_WRITABLE) of 'fd'
+ * in C; it may add or remove native handlers, including its own. */
+typedef void (*luahop_NativeFn)(luahop_Loop *loop, int fd, int mask, void *udata);
+
+typedef struct luahop_Api {
+    int version;
+    
+    /* Returns the inbox made by loop:inbox(name, fn) with a new reference,
+     * or NULL if there is none. */
+    luahop_Inbox *(*inbox_open)(const char *name);
+    /* Posts a string message. Returns 0, or -1 with errno set to EAGAIN
+     * (the inbox is full), EPIPE (its loop is gone) or ENOMEM. */
+    int (*inbox_post)(luahop_Inbox *inbox, const char *data, size_t len);
+    /* Releases a reference taken by inbox_open */
+    void (*inbox_release)(luahop_Inbox *inbox);
+    
+    /* Returns the loop at index 'idx' of the stack, or NULL if it isn't one.
+     * The loop is valid as long as the Lua value is referenced. */
+    luahop_Loop *(*loop_get)(lua_State *L, int idx);
+    /* Calls fn(loop, fd, mask, udata) when 'fd' gets any of 'mask', before
+     * the Lua callbacks of the same poll. Calling it again for 'fd' replaces
+     * the mask, fn and udata. Returns 0, or -1 if the fd has a Lua listener
+     * or can't be polled. udata is never freed by the loop. */
+    int (*native_add)(luahop_Loop *loop, int fd, int mask, luahop_NativeFn fn, void *udata);
+    /* Removes the native handler of 'fd', if any */
+    void (*native_remove)(luahop_Loop *loop, int fd);
+} luahop_Api;
+
+/** Returns the API table, or NULL if luahop wasn't required in 'L'.
+ **/
+static inline const luahop_Api *luahop_getapi(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUAHOP_API_KEY);
+    const luahop_Api *api = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    
+    return api;
+}
+
+#endif
@@ -0,0 +1,63 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Stable C ABI of the loop core, for LuaJIT's FFI (see lua/hopffi.lua).
+ * It has no Lua types, so the declarations below can be passed to
+ * ffi.cdef as they are (without the preprocessor lines). 'loop' is the
+ * payload of a luahop loop userdata, which ffi.cast("void *", loop) gives.
+ *
+ * FFI listeners are level-triggered and have no callbacks in C: a poll
+ * copies their events to an array, and the caller dispatches them. The
+ * other events of the poll (timers, loop:setlistener fds, signals...) stay
+ * pending until loop:dispatch() runs them, so both kinds share one loop. */
+
+#ifndef __LUAHOP_FFI_H__
+#define __LUAHOP_FFI_H__
+
+#define LUAHOP_FFI_VERSION 1
+#define LUAHOP_FFI_READABLE 1
+#define LUAHOP_FFI_WRITABLE 2
+
+typedef struct luahop_event {
+    int fd;
+    int mask; /* LUAHOP_FFI_READABLE | LUAHOP_FFI_WRITABLE */
+} luahop_event;
+
+int luahop_ffi_version(void);
+/* Adds 'mask' to the FFI listener of 'fd'. Returns 0, or -1 if the fd has
+ * a loop:setlistener listener or can't be polled. */
+int luahop_ffi_listen(void *loop, int fd, int mask);
+/* Drops 'mask' from the FFI listener of 'fd'. */
+void luahop_ffi_unlisten(void *loop, int fd, int mask);
+/* Polls for up to 'timeout_ns' (forever if negative; without blocking
+ * while deferred functions, idle hooks or carried over events wait) and
+ * copies up to 'max' FFI events to 'out'; events over 'max' are reported
+ * again by the next poll. Returns their number, or -1 if the backend
+ * failed. Returns 0 without polling while events are pending. */
+int luahop_ffi_poll(void *loop, long long timeout_ns, luahop_event *out, int max);
+/* Returns non-zero if loop:dispatch() has something to run: pending
+ * events, carried over events, check hooks, deferred functions or
+ * deadlines to check. */
+int luahop_ffi_pending(void *loop);
+/* Returns non-zero once after loop:stop(). */
+int luahop_ffi_stopped(void *loop);
+
+#endif
@@ -29,15 +29,42 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE /* accept4 */
 #include <lua.h>
 #include <lauxlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <assert.h>
 #include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include "config.h"
 #include "hoploop.h"
+#include "luahop.h"
+#include "luahop_ffi.h"
 
-static snHopLoop *createLoop(); //backend-specific; defined in *_hop.c
+#ifdef HAVE_SIGNALFD
+#include <signal.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#endif
+
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+/* backend-specific; defined in *_hop.c. Fills hloop->api with the functions
+ of the requested backend (or of the best available one, if NULL) */
+static int createLoop(snHopLoop *hloop, const char *backend);
 
 #ifdef HAVE_EPOLL
     #include "epoll_hop.c"
@@ -85,7 +112,7 @@ static double convert_to_usec(const char *tunit, double val) {
 static double table_to_usec(lua_State *L, int tidx) {
     int i = 0;
     const char *tunit;
-    int usec_total = 0;
+    double usec_total = 0;
     
     while ((tunit = time_units[i])) {
         lua_getfield(L, tidx, time_units[i]);
@@ -104,57 +131,260 @@ static double table_to_usec(lua_State *L, int tidx) {
     return usec_total;
 }
 
+/* IMPORTANT: mode_modifiers and modifier_masks have to be in sync */
+/* Modifiers are appended to a listener mode, e.g. "r+et" or "w+et+oneshot":
+ edge-triggered, disabled after the first event (see loop:rearm),
+ woken up exclusively (for listening sockets shared by cluster workers),
+ dispatched first or last (see loop:budget) */
+static const char* mode_modifiers[] = {"et",    "oneshot",  "exclusive",  "high",  "low",  NULL};
+static const int modifier_masks[] =   {SN_EDGE, SN_ONESHOT, SN_EXCLUSIVE, SN_HIGH, SN_LOW};
+
 /** Returns a numerical representation for string.
  **/
 static int getMask(const char *chFilter) {
-    if (strncmp(chFilter, "r", 2) == 0) return SN_READABLE;
-    else if (strncmp(chFilter, "w", 2) == 0) return SN_WRITABLE;
-    else if (strncmp(chFilter, "rw", 3) == 0) return SN_READABLE | SN_WRITABLE;
-    else if (strncmp(chFilter, "timer", 6) == 0) return SN_TIMER;
-    else return -1;
+    const char *mod;
+    int mask;
+    
+    switch (chFilter[0]) {
+        case 'r':
+            if (chFilter[1] == 'w') {
+                mask = SN_READABLE | SN_WRITABLE;
+                mod = chFilter + 2;
+            } else {
+                mask = SN_READABLE;
+                mod = chFilter + 1;
+            }
+            break;
+        case 'w':
+            mask = SN_WRITABLE;
+            mod = chFilter + 1;
+            break;
+        case 't':
+            return strcmp(chFilter, "timer") == 0 ? SN_TIMER : -1;
+        default:
+            return -1;
+    }
+    
+    if (*mod == '\0') return mask;
+    if (*mod != '+') return -1;
+    
+    while (mod) {
+        const char *name = mod + 1;
+        const char *m;
+        size_t len;
+        int i = 0;
+        
+        mod = strchr(name, '+');
+        len = mod ? (size_t) (mod - name) : strlen(name);
+        while ((m = mode_modifiers[i])) {
+            if (strlen(m) == len && strncmp(name, m, len) == 0) break;
+            i++;
+        }
+        if (!m) return -1;
+        mask |= modifier_masks[i];
+    }
+    
+    return mask;
 }
 
 /** Returns string representation for a numerical value.
  **/
 static const char *getChMask(int mask) {
-    if (mask & SN_READABLE & SN_WRITABLE) return "rw";
+    if ((mask & SN_READABLE) && (mask & SN_WRITABLE)) return "rw";
     else if (mask & SN_READABLE) return "r";
     else if (mask & SN_WRITABLE) return "w";
     else if (mask & SN_TIMER) return "timer";
     else return "";
 }
 
-static int hop_create(lua_State *L) {
-    snHopLoop *src = createLoop(L);
-    if (!src) return luaL_error(L, "Could not create snHopLoop.");
+/* The strings of getChMask are kept in the environment table under these
+ keys, to push them without hashing. They are below LUA_REFNIL and
+ LUA_NOREF, so no reference (not even a missing one) can point at them. */
+#define SN_MODEMASK (SN_READABLE | SN_WRITABLE | SN_TIMER)
+#define getModeKey(mask) (-16 - ((mask) & SN_MODEMASK))
+
+static void pushChMask(lua_State *L, int mask) {
+    lua_rawgeti(L, LUA_ENVIRONINDEX, getModeKey(mask));
+}
+
+/** Returns the number of file descriptors this process is allowed to open.
+ **/
+static int getFdLimit(void) {
+    struct rlimit rl;
     
-    snHopLoop *hloop = lua_newuserdata(L, sizeof(snHopLoop));
-    if (!hloop) {
-        free(src);
-        return luaL_error(L, "Could not create snHopLoop.");
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) return SN_INITSETSIZE;
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX) return INT_MAX;
+    
+    return (int) rl.rlim_cur;
+}
+
+/** Returns a new table size (doubled as many times as needed), 
+ * which is big enough to hold 'id' but never bigger than 'limit'.
+ **/
+static int nextSize(int size, int id, int limit) {
+    if (size < SN_INITSETSIZE) size = SN_INITSETSIZE;
+    while (size <= id) {
+        size = (size > limit / 2) ? limit : size * 2;
     }
     
-    memcpy(hloop, src, sizeof(snHopLoop));
-    luaL_getmetatable(L, "pl.makenika.hoploop");
-    lua_setmetatable(L, -2);
+    return size;
+}
+
+/** Makes sure that 'fd' fits in the file event tables.
+ * The tables grow on demand, up to the RLIMIT_NOFILE limit,
+ * so the memory used by a loop follows the highest registered fd.
+ **/
+static int growEvents(snHopLoop *hloop, int fd) {
+    if (fd < hloop->setsize) return fd < 0 ? -1 : 0;
     
-    int i = 0;
-    for (i = 0; i < SN_SETSIZE; i++) {
+    int limit = getFdLimit();
+    if (fd >= limit) return -1;
+    
+    int setsize = nextSize(hloop->setsize, fd, limit);
+    snFileEvent *events = realloc(hloop->events, sizeof(snFileEvent) * setsize);
+    if (!events) return -1;
+    hloop->events = events;
+    
+    snFileExt **exts = realloc(hloop->exts, sizeof(snFileExt *) * setsize);
+    if (!exts) return -1;
+    hloop->exts = exts;
+    
+    if (growFired(hloop, setsize) == -1) return -1;
+    if (hloop->api->resize(hloop, setsize) == -1) return -1;
+    
+    int i;
+    for (i = hloop->setsize; i < setsize; i++) {
         hloop->events[i].mask = SN_NONE;
-        hloop->timers[i].mask = SN_NONE;
+        hloop->events[i].rcallback = LUA_NOREF;
+        hloop->events[i].wcallback = LUA_NOREF;
+        hloop->events[i].carried = 0;
+        hloop->events[i].deadline = 0;
+        hloop->exts[i] = NULL;
     }
+    hloop->setsize = setsize;
     
-    hloop->shouldStop = 0;
+    return 0;
+}
+
+/** Makes sure that timer 'id' fits in the timers table.
+ **/
+static int growTimers(snHopLoop *hloop, int id) {
+    if (id < hloop->timersize) return id < 0 ? -1 : 0;
+    if (id == INT_MAX) return -1;
+    
+    int timersize = nextSize(hloop->timersize, id, INT_MAX);
+    snTimerEvent *timers = realloc(hloop->timers, sizeof(snTimerEvent) * timersize);
+    if (!timers) return -1;
+    
+    int i;
+    for (i = hloop->timersize; i < timersize; i++) {
+        timers[i].mask = SN_NONE;
+    }
+    hloop->timers = timers;
+    hloop->timersize = timersize;
+    
+    return 0;
+}
+
+/** Makes sure that the fired table has room for 'n' events.
+ **/
+static int growFired(snHopLoop *hloop, int n) {
+    if (n <= hloop->firedsize) return 0;
+    
+    int firedsize = nextSize(hloop->firedsize, n - 1, INT_MAX);
+    snFiredEvent *fired = realloc(hloop->fired, sizeof(snFiredEvent) * firedsize);
+    if (!fired) return -1;
+    hloop->fired = fired;
+    hloop->firedsize = firedsize;
+    
+    return 0;
+}
+
+/** Returns the rarely used data of 'fd', allocating it if needed.
+ * 'fd' has to fit in the event tables already.
+ **/
+static snFileExt *getFileExt(snHopLoop *hloop, int fd) {
+    snFileExt *ext = hloop->exts[fd];
+    if (ext) return ext;
+    
+    ext = calloc(1, sizeof(snFileExt));
+    if (!ext) return NULL;
+    ext->drain = LUA_NOREF;
+    ext->highwater = LUA_NOREF;
+    ext->sendcallback = LUA_NOREF;
+    ext->dlcallback = LUA_NOREF;
+    ext->dlnext = -1;
+    ext->dlprev = -1;
+    hloop->exts[fd] = ext;
+    
+    return ext;
+}
+
+static void clearDeadline(lua_State *L, snHopLoop *hloop, int fd);
+
+static void freeFileExt(lua_State *L, snHopLoop *hloop, int fd) {
+    snFileExt *ext = hloop->exts[fd];
+    if (!ext) return;
+    
+    clearDeadline(L, hloop, fd); /* the ext links the fd into its bucket */
+    free(ext->chunks);
+    free(ext->dgrams);
+    free(ext);
+    hloop->exts[fd] = NULL;
+}
+
+/** Releases everything owned by the loop (but not the loop itself).
+ **/
+static void freeSignals(lua_State *L, snHopLoop *hloop);
+static void freeInbox(lua_State *L, snHopLoop *hloop);
+static void freePool(lua_State *L, snHopLoop *hloop);
+
+static void freeLoop(lua_State *L, snHopLoop *hloop) {
+    int i;
+    
+    freeSignals(L, hloop);
+    freeInbox(L, hloop);
+    freePool(L, hloop);
+    hloop->api->closeLoop(hloop);
+    for (i = 0; i < hloop->setsize; i++) freeFileExt(L, hloop, i);
+    
+    free(hloop->exts);
+    free(hloop->api);
+    free(hloop->state);
+    free(hloop->events);
+    free(hloop->timers);
+    free(hloop->fired);
+    free(hloop->deferred.refs);
+    free(hloop->idle.refs);
+    free(hloop->prepare.refs);
+    free(hloop->check.refs);
+    free(hloop->carry);
+    free(hloop->deadlines);
+    if (hloop->buffers) snBufferPoolRelease(hloop->buffers);
+}
+
+static int hop_create(lua_State *L) {
+    const char *backend = luaL_optstring(L, 1, NULL);
+    snHopLoop *hloop = lua_newuserdata(L, sizeof(snHopLoop));
+    memset(hloop, 0, sizeof(snHopLoop));
     
-    hloop->api->addEvent = addEvent;
-    hloop->api->removeEvent = removeEvent;
-    hloop->api->poll = poll;
+    if (createLoop(hloop, backend) == -1) {
+        if (backend) return luaL_error(L, "Backend '%s' is not available.", backend);
+        return luaL_error(L, "Could not create snHopLoop.");
+    }
+    
+    if (growEvents(hloop, SN_INITSETSIZE - 1) == -1 ||
+        growTimers(hloop, SN_INITSETSIZE - 1) == -1) {
+        freeLoop(L, hloop);
+        return luaL_error(L, "Could not create snHopLoop.");
+    }
     
-    hloop->api->setTimeout = setTimeout;
-    hloop->api->setInterval = setInterval;
-    hloop->api->clearTimer = clearTimer;
+    luaL_getmetatable(L, "pl.makenika.hoploop");
+    lua_setmetatable(L, -2);
     
-    free(src);
+    hloop->worker = snGetWorkerStats(L);
+    hloop->now = snNanoTime();
+    hloop->shouldStop = 0;
     
     return 1;
 }
@@ -165,44 +395,89 @@ static int hop_addEvent(lua_State *L) {
     const char *chFilter = luaL_checkstring(L, 3);
     if (! lua_isfunction(L, 4)) return luaL_error(L, "Function was expected.");
 
-    if (fd > SN_SETSIZE) {
-        return luaL_error(L, "File descriptor outside SN_SETSIZE");
+    if (growEvents(hloop, fd) == -1) {
+        return luaL_error(L, "File descriptor outside RLIMIT_NOFILE");
     }
     
     int mask = getMask(chFilter);
     if (mask == -1) return luaL_error(L, "Invalid event mask.");
+    if (hloop->events[fd].mask & (SN_NATIVE | SN_FFI)) {
+        return luaL_error(L, "The fd is handled in C.");
+    }
+    /* a mode has one owner: a listener can't take it from a waiting coroutine */
+    if (((mask & SN_READABLE) && (hloop->events[fd].mask & SN_RWAIT)) ||
+        ((mask & SN_WRITABLE) && (hloop->events[fd].mask & SN_WWAIT))) {
+        return luaL_error(L, "File descriptor already has a listener.");
+    }
     
     if (hloop->api->addEvent(hloop, fd, mask) == -1) {
         return luaL_error(L, "Could not add event listener.");
     }
     
     int clbref = luaL_ref(L, LUA_ENVIRONINDEX);
+    if (mask & (SN_HIGH | SN_LOW)) hloop->prioritized = 1;
     hloop->events[fd].L = L;
     hloop->events[fd].mask |= mask;
-    if (mask & SN_READABLE) hloop->events[fd].rcallback = clbref;
-    if (mask & SN_WRITABLE) hloop->events[fd].wcallback = clbref;
+    if (mask & SN_READABLE) {
+        hloop->events[fd].rcallback = clbref;
+        hloop->events[fd].mask &= ~SN_RWAIT;
+    }
+    if (mask & SN_WRITABLE) {
+        hloop->events[fd].wcallback = clbref;
+        hloop->events[fd].mask &= ~SN_WWAIT;
+    }
     
     return 0;
 }
 
-static int _removeEvent(lua_State *L, int fd, int mask, snHopLoop *hloop) {
-    if (mask == -1) return luaL_error(L, "Invalid event mask.");
-    
-    if (fd >= SN_SETSIZE) return 0;
-    if (hloop->events[fd].mask == SN_NONE) return 0;
+/** Drops 'mask' from the interest of 'fd' and tells the backend about it.
+ **/
+static void clearMask(snHopLoop *hloop, int fd, int mask) {
+    if (mask & SN_READABLE) mask |= SN_RWAIT;
+    if (mask & SN_WRITABLE) mask |= SN_WWAIT;
     hloop->events[fd].mask = hloop->events[fd].mask & (~mask);
+    if (!(hloop->events[fd].mask & SN_POLLED)) {
+        /* the last listener is gone: +et, +oneshot, +exclusive, +high and
+         +low go with it, a new listener has to give them again */
+        hloop->events[fd].mask = SN_NONE;
+        hloop->events[fd].carried = 0; /* a carried over event is stale now */
+    }
     
     hloop->api->removeEvent(hloop, fd, mask);
+}
+
+/** Releases a callback reference of the environment table, if there is one.
+ **/
+static void releaseRef(lua_State *L, int ref) {
+    if (ref != LUA_NOREF) luaL_unref(L, LUA_ENVIRONINDEX, ref);
+}
+
+static int _removeEvent(lua_State *L, int fd, int mask, snHopLoop *hloop) {
+    if (mask == -1) return luaL_error(L, "Invalid event mask.");
     
-    if (mask & SN_READABLE) {
-        lua_pushnil(L);
-        lua_rawseti(L, LUA_ENVIRONINDEX, hloop->events[fd].rcallback);
-    }
-    if (mask & SN_WRITABLE) {
-        lua_pushnil(L);
-        lua_rawseti(L, LUA_ENVIRONINDEX, hloop->events[fd].wcallback);
+    if (fd < 0 || fd >= hloop->setsize) return 0;
+    mask &= hloop->events[fd].mask & (SN_READABLE | SN_WRITABLE);
+    if (mask == SN_NONE) return 0;
+    
+    /* fds of C code (native_add, the FFI path, the loop's own eventfds) are
+     removed by their owner; acceptors and datagram listeners have a Lua
+     callback and are removed here */
+    int fdmask = hloop->events[fd].mask;
+    if ((fdmask & SN_FFI) || ((fdmask & SN_NATIVE) && hloop->events[fd].rcallback == LUA_NOREF)) {
+        return luaL_error(L, "The fd is handled in C.");
     }
     
+    clearMask(hloop, fd, mask);
+    
+    /* an "rw" listener has one reference for both modes; it's released
+     once neither of them uses it */
+    snFileEvent *evData = &hloop->events[fd];
+    int rref = evData->rcallback, wref = evData->wcallback;
+    if (mask & SN_READABLE) evData->rcallback = LUA_NOREF;
+    if (mask & SN_WRITABLE) evData->wcallback = LUA_NOREF;
+    if ((mask & SN_READABLE) && rref != evData->wcallback) releaseRef(L, rref);
+    if ((mask & SN_WRITABLE) && wref != evData->rcallback && wref != rref) releaseRef(L, wref);
+    
     return 0;
 }
 
@@ -217,186 +492,2420 @@ static int hop_removeEvent(lua_State *L) {
     return _removeEvent(L, fd, mask, hloop);
 }
 
-static int _setTimer(lua_State *L, int timerType) {
+/** Enables a "oneshot" listener again, after it has fired.
+ **/
+static int hop_rearmEvent(lua_State *L) {
     snHopLoop *hloop = checkLoop(L);
-    luaL_checktype(L, 2, LUA_TTABLE);
-    if (! lua_isfunction(L, 3)) return luaL_error(L, "Function was expexted.");
-    int fd = 0;
-    
-    struct timeval tv;
-    int usec_total = table_to_usec(L, 2);
-    
-    tv.tv_sec = (long int) (usec_total / SIM);
-    tv.tv_usec = (long int) fmod(usec_total, SIM);
-    
-    int clbref = luaL_ref(L, LUA_ENVIRONINDEX);
+    int fd = luaL_checknumber(L, 2);
     
-    if (timerType & SN_ONCE)
-        fd = hloop->api->setTimeout(hloop, &tv);
-    else
-        fd = hloop->api->setInterval(hloop, &tv);
+    if (fd < 0 || fd >= hloop->setsize) return 0;
+    if (!(hloop->events[fd].mask & SN_ONESHOT)) return 0;
     
-    if (fd == -1) {
-        lua_pushnumber(L, -1);
-        lua_pushstring(L, "Could not create a new timer (internal error)");
-        
-        lua_pushnil(L);
-        lua_rawseti(L, LUA_ENVIRONINDEX, clbref);
-        
-        return 2;
+    if (hloop->api->rearmEvent(hloop, fd) == -1) {
+        return luaL_error(L, "Could not re-arm event listener.");
     }
     
-    hloop->timers[fd].L = L;
-    hloop->timers[fd].callback = clbref;
-    hloop->timers[fd].mask = SN_TIMER;
-    if (timerType & SN_ONCE) hloop->timers[fd].mask |= SN_ONCE;
-    
-    lua_pushnumber(L, fd);
-    
-    return 1;
+    return 0;
 }
 
-static int hop_setTimeout(lua_State *L) {
-    return _setTimer(L, SN_ONCE);
+/* Acceptor.
+ * A listening socket is handled in C (SN_NATIVE): each readiness drains the
+ * backlog with accept4, up to acceptmax connections, so a storm of
+ * connections doesn't starve the other fds. What's left is accepted in the
+ * next iteration (the listener is level-triggered). */
+
+#define SN_ACCEPT_MAX 64
+#define SN_ACCEPT_BATCH 1 /* fn(loop, fds) once per iteration */
+#define SN_ACCEPT_NODELAY 2
+#define SN_ACCEPT_KEEPALIVE 4
+
+/** Accepts a connection as a non-blocking, close-on-exec fd.
+ **/
+static int acceptSocket(int fd, struct sockaddr_storage *addr, socklen_t *addrlen) {
+#ifdef HAVE_ACCEPT4
+    return accept4(fd, (struct sockaddr *) addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int cfd = accept(fd, (struct sockaddr *) addr, addrlen);
+    if (cfd == -1) return -1;
+    if (fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK) == -1 ||
+        fcntl(cfd, F_SETFD, FD_CLOEXEC) == -1) {
+        close(cfd);
+        return -1;
+    }
+    return cfd;
+#endif
 }
 
-static int hop_setInterval(lua_State *L) {
-    return _setTimer(L, 0);
+static void setAcceptOpts(int cfd, int opts) {
+    int on = 1;
+    /* fails harmlessly on unix sockets */
+    if (opts & SN_ACCEPT_NODELAY) setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (opts & SN_ACCEPT_KEEPALIVE) setsockopt(cfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
 }
 
-static int _clearTimer(lua_State *L, snHopLoop *hloop, int fd) {
-    if (hloop->timers[fd].mask == SN_NONE) return 0;
-    hloop->timers[fd].mask = SN_NONE;
-    
-    hloop->api->clearTimer(hloop, fd);
+/** Pushes the ip and port of an address; pushes nothing for other families.
+ * Returns the number of pushed values.
+ **/
+static int pushAddress(lua_State *L, struct sockaddr_storage *addr) {
+    char ip[INET6_ADDRSTRLEN];
     
-    lua_pushnil(L);
-    lua_rawseti(L, LUA_ENVIRONINDEX, hloop->timers[fd].callback);
+    if (addr->ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *) addr;
+        inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+        lua_pushstring(L, ip);
+        lua_pushnumber(L, ntohs(in->sin_port));
+        return 2;
+    }
+    if (addr->ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+        lua_pushstring(L, ip);
+        lua_pushnumber(L, ntohs(in6->sin6_port));
+        return 2;
+    }
     
     return 0;
 }
 
-static int hop_clearTimer(lua_State *L) {
-    snHopLoop *hloop = checkLoop(L);
-    int fd = luaL_checknumber(L, 2);
+/* snNativeHandler of a loop:acceptor socket */
+static void handleAccept(lua_State *L, snHopLoop *hloop, int fd, int mask) {
+    snFileExt *ext = hloop->exts[fd];
+    int opts = ext->acceptopts;
+    int max = ext->acceptmax;
+    int count = 0;
+    const char *err = NULL;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    (void) mask;
     
-    return _clearTimer(L, hloop, fd);
+    if (opts & SN_ACCEPT_BATCH) lua_newtable(L);
+    while (count < max) {
+        addrlen = sizeof(addr);
+        int cfd = acceptSocket(fd, &addr, &addrlen);
+        if (cfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            /* EMFILE leaves the connection in the backlog, so it's reported
+             in every iteration until the callback makes room */
+            if (errno != EAGAIN && errno != EWOULDBLOCK) err = strerror(errno);
+            break;
+        }
+        count++;
+        setAcceptOpts(cfd, opts);
+        
+        if (opts & SN_ACCEPT_BATCH) {
+            lua_pushnumber(L, cfd);
+            lua_rawseti(L, -2, count);
+            continue;
+        }
+        
+        lua_rawgeti(L, LUA_ENVIRONINDEX, hloop->events[fd].rcallback);
+        lua_pushvalue(L, 1);
+        lua_pushnumber(L, cfd);
+        int nargs = 2 + pushAddress(L, &addr);
+        if (lua_pcall(L, nargs, 0, 0) != 0) lua_pop(L, 1);
+        
+        /* the callback may remove the acceptor */
+        if (!(hloop->events[fd].mask & SN_NATIVE)) return;
+    }
+    
+    if (opts & SN_ACCEPT_BATCH) {
+        if (count == 0) {
+            lua_pop(L, 1);
+            if (!err) return;
+            lua_pushnil(L); /* nil, errmsg as without batch */
+        }
+        lua_rawgeti(L, LUA_ENVIRONINDEX, hloop->events[fd].rcallback);
+        lua_insert(L, -2);
+        lua_pushvalue(L, 1);
+        lua_insert(L, -2);
+    } else {
+        if (!err) return;
+        lua_rawgeti(L, LUA_ENVIRONINDEX, hloop->events[fd].rcallback);
+        lua_pushvalue(L, 1);
+        lua_pushnil(L);
+    }
+    if (err) lua_pushstring(L, err);
+    else lua_pushnil(L);
+    if (lua_pcall(L, 3, 0, 0) != 0) lua_pop(L, 1);
 }
 
-/** Runs a specified callback.
- * IMPORTANT: this function expects, that 
- * luaL_checkudata(L, 1, "pl.makenika.hoploop") will return a valid luahop object.
+/** loop:acceptor(fd, fn[, options])
+ * Accepts the connections of the listening socket 'fd' in C. New fds are
+ * non-blocking and close-on-exec. fn(loop, cfd, ip, port) is called for each
+ * connection, or fn(loop, fds) once per iteration with options.batch; on
+ * errors it gets nil (or the fds accepted so far) and an error message.
+ * options: max (64) connections per iteration, nodelay, keepalive, and
+ * exclusive (see the "exclusive" listener modifier).
+ * loop:rmlistener(fd, "r") removes the acceptor.
  **/
-static int run_callback(lua_State *L, lua_State *ctx, int clbref, int fd, int mask, snHopLoop *hloop) {
-    lua_rawgeti(L, LUA_ENVIRONINDEX, clbref);
-    if (!lua_isfunction(L, -1)) return luaL_error(L, "Function was expected");
+static int hop_acceptor(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int fd = luaL_checknumber(L, 2);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    int opts = 0, max = SN_ACCEPT_MAX, mask = SN_READABLE;
     
-    if (ctx != L) {
-        //copy callback function to ctx Lua state
-        lua_xmove(L, ctx, 1);
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+        lua_getfield(L, 4, "max");
+        max = luaL_optnumber(L, -1, SN_ACCEPT_MAX);
+        lua_getfield(L, 4, "batch");
+        if (lua_toboolean(L, -1)) opts |= SN_ACCEPT_BATCH;
+        lua_getfield(L, 4, "nodelay");
+        if (lua_toboolean(L, -1)) opts |= SN_ACCEPT_NODELAY;
+        lua_getfield(L, 4, "keepalive");
+        if (lua_toboolean(L, -1)) opts |= SN_ACCEPT_KEEPALIVE;
+        lua_getfield(L, 4, "exclusive");
+        if (lua_toboolean(L, -1)) mask |= SN_EXCLUSIVE;
+        if (max < 1) return luaL_error(L, "Invalid max.");
     }
+    lua_settop(L, 3);
     
-    //call user function: callback(loop, fd, type)
-    lua_pushvalue(L, 1);
-    if (ctx != L) lua_xmove(L, ctx, 1);
-    lua_pushnumber(ctx, fd);
-    lua_pushstring(ctx, getChMask(mask));
-
-    lua_pcall(ctx, 3, 0, 0);
+    if (growEvents(hloop, fd) == -1) {
+        return luaL_error(L, "File descriptor outside RLIMIT_NOFILE");
+    }
+    if (hloop->events[fd].mask & SN_POLLED) {
+        return luaL_error(L, "The fd has a listener already.");
+    }
+    
+    snFileExt *ext = getFileExt(hloop, fd);
+    if (!ext || hloop->api->addEvent(hloop, fd, mask) == -1) {
+        return luaL_error(L, "Could not add event listener.");
+    }
+    ext->handler = handleAccept;
+    ext->acceptmax = max;
+    ext->acceptopts = opts;
+    hloop->events[fd].L = L;
+    hloop->events[fd].rcallback = luaL_ref(L, LUA_ENVIRONINDEX);
+    hloop->events[fd].mask |= mask | SN_NATIVE;
     
     return 0;
 }
 
-static int hop_poll(lua_State *L) {
-    snHopLoop *hloop = checkLoop(L);
-    struct timeval *tv = NULL;
-    double usec_total = 0;
+/* Datagrams.
+ * A datagram socket is handled in C (SN_NATIVE): each readiness receives up
+ * to dgrammax packets with one recvmmsg, into buffers which the listener
+ * keeps, and hands them to Lua in one call. loop:sendbatch sends many
+ * packets with one sendmmsg. */
+
+#define SN_DGRAM_MAX 256 /* Packets per recvmmsg/sendmmsg */
+#define SN_DGRAM_BATCH 32
+#define SN_DGRAM_SIZE 2048
+
+#ifndef HAVE_MMSG
+/* one recvmsg/sendmsg per packet */
+#define mmsghdr snMmsgHdr
+struct snMmsgHdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+static int snRecvmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags, void *timeout) {
+    unsigned int i;
+    (void) timeout;
+    for (i = 0; i < n; i++) {
+        ssize_t len = recvmsg(fd, &msgs[i].msg_hdr, flags);
+        if (len == -1) return i > 0 ? (int) i : -1;
+        msgs[i].msg_len = len;
+    }
+    return i;
+}
+
+static int snSendmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags) {
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        ssize_t len = sendmsg(fd, &msgs[i].msg_hdr, flags);
+        if (len == -1) return i > 0 ? (int) i : -1;
+        msgs[i].msg_len = len;
+    }
+    return i;
+}
+#define recvmmsg snRecvmmsg
+#define sendmmsg snSendmmsg
+#endif
+
+/* snNativeHandler of a loop:datagram socket */
+static void handleDatagrams(lua_State *L, snHopLoop *hloop, int fd, int mask) {
+    snFileExt *ext = hloop->exts[fd];
+    struct mmsghdr msgs[SN_DGRAM_MAX];
+    struct iovec iovs[SN_DGRAM_MAX];
+    struct sockaddr_storage *addrs = (struct sockaddr_storage *) ext->dgrams;
+    char *data = ext->dgrams + sizeof(struct sockaddr_storage) * ext->dgrammax;
+    int i, n;
+    (void) mask;
     
-    if (lua_istable(L, 2)) {
-        usec_total = table_to_usec(L, 2);
-        
-        if (usec_total > 0) {
-            tv = malloc(sizeof(struct timeval));
-            tv->tv_sec = (long int) (usec_total / SIM);
-            tv->tv_usec = (long int) fmod(usec_total, SIM);
-        }
+    memset(msgs, 0, sizeof(struct mmsghdr) * ext->dgrammax);
+    for (i = 0; i < ext->dgrammax; i++) {
+        iovs[i].iov_base = data + (size_t) i * ext->dgramsize;
+        iovs[i].iov_len = ext->dgramsize;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
     }
     
-    int nevents = hloop->api->poll(hloop, tv);
-    if (tv != NULL) free(tv);
+    do {
+        n = recvmmsg(fd, msgs, ext->dgrammax, MSG_DONTWAIT, NULL);
+    } while (n == -1 && errno == EINTR);
     
-    int i = 0;
-    for (i=0; i<nevents; i++) {
-        snFiredEvent fevent = hloop->fired[i];
-        int mask = fevent.mask;
-        int fd = fevent.fd;
-        
-        if (mask & SN_TIMER) { /* timer event */
-            snTimerEvent *timerEvent = &hloop->timers[fd];
-            lua_State *ctx = timerEvent->L;
-            
-            if (timerEvent->mask & mask & SN_TIMER) {
-                int callback = timerEvent->callback;
-                run_callback(L, ctx, callback, fd, mask, hloop);
-                
-                if (timerEvent->mask & SN_ONCE) {
-                    _clearTimer(L, hloop, fd);
-                }
-            }
-        } else { /* <file event> */
-            snFileEvent *evData = &hloop->events[fd];
-            lua_State *ctx = evData->L;
-            int rcallback = evData->rcallback;
-            int wcallback = evData->wcallback;
-            int rfired = 0;
-            
-            if (evData->mask & mask & SN_READABLE) {
-                rfired = 1;
-                run_callback(L, ctx, rcallback, fd, mask, NULL);
-            }
-            if (evData->mask & mask & SN_WRITABLE) {
-                if (!rfired || evData->wcallback != evData->rcallback) {
-                    run_callback(L, ctx, wcallback, fd, mask, NULL);
-                }
-            }
-        } /* </file event> */
+    lua_rawgeti(L, LUA_ENVIRONINDEX, hloop->events[fd].rcallback);
+    lua_pushvalue(L, 1);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            lua_pop(L, 2);
+            return;
+        }
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        if (lua_pcall(L, 3, 0, 0) != 0) lua_pop(L, 1);
+        return;
     }
     
-    return 0;
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+        lua_createtable(L, 0, 3);
+        lua_pushlstring(L, iovs[i].iov_base, msgs[i].msg_len);
+        lua_setfield(L, -2, "data");
+        if (msgs[i].msg_hdr.msg_namelen > 0 && pushAddress(L, &addrs[i]) == 2) {
+            lua_setfield(L, -3, "port");
+            lua_setfield(L, -2, "ip");
+        }
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            lua_pushboolean(L, 1);
+            lua_setfield(L, -2, "truncated");
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    if (lua_pcall(L, 2, 0, 0) != 0) lua_pop(L, 1);
 }
 
-static int hop_stop(lua_State *L) {
+/** loop:datagram(fd, fn[, options])
+ * Receives the packets of the datagram socket 'fd' in batches:
+ * fn(loop, packets), where each packet is {data=, ip=, port=} (and
+ * truncated=true if it didn't fit); on errors fn(loop, nil, message).
+ * options: max (32, up to 256) packets per batch and size (2048) bytes
+ * per packet. loop:rmlistener(fd, "r") removes the listener.
+ **/
+static int hop_datagram(lua_State *L) {
     snHopLoop *hloop = checkLoop(L);
-    hloop->shouldStop = 1;
+    int fd = luaL_checknumber(L, 2);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    int max = SN_DGRAM_BATCH, size = SN_DGRAM_SIZE;
+    
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+        lua_getfield(L, 4, "max");
+        max = luaL_optnumber(L, -1, SN_DGRAM_BATCH);
+        lua_getfield(L, 4, "size");
+        size = luaL_optnumber(L, -1, SN_DGRAM_SIZE);
+        if (max < 1 || max > SN_DGRAM_MAX) return luaL_error(L, "Invalid max.");
+        if (size < 1) return luaL_error(L, "Invalid size.");
+    }
+    lua_settop(L, 3);
+    
+    if (growEvents(hloop, fd) == -1) {
+        return luaL_error(L, "File descriptor outside RLIMIT_NOFILE");
+    }
+    if (hloop->events[fd].mask & SN_POLLED) {
+        return luaL_error(L, "The fd has a listener already.");
+    }
+    
+    snFileExt *ext = getFileExt(hloop, fd);
+    if (!ext) return luaL_error(L, "Could not add event listener.");
+    if (!ext->dgrams || ext->dgrammax != max || ext->dgramsize != size) {
+        free(ext->dgrams);
+        ext->dgrams = malloc((sizeof(struct sockaddr_storage) + size) * (size_t) max);
+        if (!ext->dgrams) return luaL_error(L, "Out of memory.");
+        ext->dgrammax = max;
+        ext->dgramsize = size;
+    }
+    if (hloop->api->addEvent(hloop, fd, SN_READABLE) == -1) {
+        return luaL_error(L, "Could not add event listener.");
+    }
+    ext->handler = handleDatagrams;
+    hloop->events[fd].L = L;
+    hloop->events[fd].rcallback = luaL_ref(L, LUA_ENVIRONINDEX);
+    hloop->events[fd].mask |= SN_READABLE | SN_NATIVE;
     
     return 0;
 }
 
-static int hop_loop(lua_State *L) {
-    snHopLoop *hloop = checkLoop(L);
-    hloop->shouldStop = 0;
+/** Reads the ip and port fields of the table on top of the stack into
+ * 'addr'. Returns the length of the address, 0 if there is no ip, or -1.
+ **/
+static socklen_t getAddress(lua_State *L, struct sockaddr_storage *addr) {
+    lua_getfield(L, -1, "ip");
+    lua_getfield(L, -2, "port");
+    const char *ip = lua_tostring(L, -2);
+    int port = lua_tonumber(L, -1);
+    socklen_t len = 0;
     
-    while (hloop->shouldStop == 0) {
-        hop_poll(L);
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    if (ip) {
+        struct sockaddr_in *in = (struct sockaddr_in *) addr;
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+        if (inet_pton(AF_INET, ip, &in->sin_addr) == 1) {
+            in->sin_family = AF_INET;
+            in->sin_port = htons(port);
+            len = sizeof(struct sockaddr_in);
+        } else if (inet_pton(AF_INET6, ip, &in6->sin6_addr) == 1) {
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = htons(port);
+            len = sizeof(struct sockaddr_in6);
+        } else {
+            len = -1;
+        }
     }
+    lua_pop(L, 2);
     
-    return 0;
+    return len;
 }
 
-static int hop_repr(lua_State *L) {
-    snHopLoop *hloop = checkLoop(L);
-    lua_pushfstring(L, "<Hop Loop: %s>", hloop->api->name);
+/** Fails loop:sendbatch on the invalid packet 'packet': raises the error
+ * 'fmt' if nothing was sent yet, otherwise returns nil, the error and the
+ * number of packets sent.
+ **/
+static int badPacket(lua_State *L, int sent, const char *fmt, int packet) {
+    if (sent == 0) return luaL_error(L, fmt, packet);
     
-    return 1;
+    lua_pushnil(L);
+    lua_pushfstring(L, fmt, packet);
+    lua_pushnumber(L, sent);
+    return 3;
+}
+
+/** loop:sendbatch(fd, packets)
+ * Sends an array of packets, {data=[, ip=, port=]} (the address may be left
+ * out on a connected socket), with as few sendmmsg calls as possible.
+ * Returns the number of packets sent, which is less than #packets when the
+ * socket buffer fills up. On errors returns nil, an error message and the
+ * number of packets sent before it.
+ **/
+static int hop_sendBatch(lua_State *L) {
+    checkLoop(L);
+    int fd = luaL_checknumber(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    int count = lua_objlen(L, 3);
+    struct mmsghdr msgs[SN_DGRAM_MAX];
+    struct iovec iovs[SN_DGRAM_MAX];
+    struct sockaddr_storage addrs[SN_DGRAM_MAX];
+    int sent = 0;
+    
+    while (sent < count) {
+        int i, n, batch = count - sent > SN_DGRAM_MAX ? SN_DGRAM_MAX : count - sent;
+        
+        memset(msgs, 0, sizeof(struct mmsghdr) * batch);
+        for (i = 0; i < batch; i++) {
+            size_t len;
+            lua_rawgeti(L, 3, sent + i + 1);
+            if (!lua_istable(L, -1)) return badPacket(L, sent, "Packet %d is not a table.", sent + i + 1);
+            lua_getfield(L, -1, "data");
+            if (lua_type(L, -1) != LUA_TSTRING) return badPacket(L, sent, "Packet %d has no data.", sent + i + 1);
+            iovs[i].iov_base = (char *) lua_tolstring(L, -1, &len);
+            iovs[i].iov_len = len;
+            lua_pop(L, 1); /* the string stays referenced by the table */
+            socklen_t addrlen = getAddress(L, &addrs[i]);
+            if (addrlen == (socklen_t) -1) return badPacket(L, sent, "Invalid ip in packet %d.", sent + i + 1);
+            lua_pop(L, 1);
+            
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = addrlen ? &addrs[i] : NULL;
+            msgs[i].msg_hdr.msg_namelen = addrlen;
+        }
+        
+        do {
+            n = sendmmsg(fd, msgs, batch, MSG_DONTWAIT);
+        } while (n == -1 && errno == EINTR);
+        
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            lua_pushnumber(L, sent);
+            return 3;
+        }
+        sent += n;
+        if (n < batch) break;
+    }
+    lua_pushnumber(L, sent);
+    
+    return 1;
+}
+
+/* Write queue.
+ * loop:write() writes right away when nothing is queued, so a small response
+ * costs one syscall. What the socket doesn't take is queued (by reference to
+ * the Lua string) and flushed with writev, when the fd becomes writable. */
+
+#define SN_IOV_MAX 64
+
+/** Calls a write queue callback with the value on top of the stack:
+ * callback(loop, fd, value). The value is left on the stack.
+ **/
+static void run_queueCallback(lua_State *L, snFileExt *ext, int clbref, int fd) {
+    lua_State *ctx = ext->L ? ext->L : L;
+    
+    lua_rawgeti(L, LUA_ENVIRONINDEX, clbref);
+    lua_pushvalue(L, 1);
+    lua_pushnumber(L, fd);
+    lua_pushvalue(L, -4);
+    if (ctx != L) lua_xmove(L, ctx, 4);
+    
+    if (lua_pcall(ctx, 3, 0, 0) != 0) lua_pop(ctx, 1);
+}
+
+/** Releases all the queued chunks, drops a loop:sendfile in progress
+ * (without calling its callback) and stops polling for writability.
+ **/
+static void discardQueue(lua_State *L, snHopLoop *hloop, int fd) {
+    snFileExt *ext = hloop->exts[fd];
+    
+    luaL_unref(L, LUA_ENVIRONINDEX, ext->sendcallback);
+    ext->sendcallback = LUA_NOREF;
+    ext->sending = 0;
+    while (ext->count > 0) {
+        luaL_unref(L, LUA_ENVIRONINDEX, ext->chunks[ext->head].ref);
+        ext->head = (ext->head + 1) % ext->capacity;
+        ext->count--;
+    }
+    ext->head = 0;
+    ext->queued = 0;
+    
+    if (hloop->events[fd].mask & SN_WQUEUE) clearMask(hloop, fd, SN_WQUEUE);
+}
+
+static int pushChunk(snFileExt *ext, const char *data, size_t len, int ref) {
+    if (ext->count == ext->capacity) {
+        int capacity = ext->capacity ? ext->capacity * 2 : 8;
+        snWriteChunk *chunks = malloc(sizeof(snWriteChunk) * capacity);
+        if (!chunks) return -1;
+        
+        int i;
+        for (i = 0; i < ext->count; i++) {
+            chunks[i] = ext->chunks[(ext->head + i) % ext->capacity];
+        }
+        free(ext->chunks);
+        ext->chunks = chunks;
+        ext->capacity = capacity;
+        ext->head = 0;
+    }
+    
+    snWriteChunk *chunk = &ext->chunks[(ext->head + ext->count) % ext->capacity];
+    chunk->data = data;
+    chunk->len = len;
+    chunk->ref = ref;
+    ext->count++;
+    ext->queued += len;
+    
+    return 0;
+}
+
+/** Ends the loop:sendfile of 'fd': callback(loop, fd, sent, err).
+ **/
+static void finishSendfile(lua_State *L, snFileExt *ext, int fd, const char *err) {
+    int ref = ext->sendcallback;
+    
+    ext->sending = 0;
+    ext->sendcallback = LUA_NOREF;
+    
+    lua_rawgeti(L, LUA_ENVIRONINDEX, ref);
+    luaL_unref(L, LUA_ENVIRONINDEX, ref);
+    lua_pushvalue(L, 1);
+    lua_pushnumber(L, fd);
+    lua_pushnumber(L, ext->sent);
+    if (err) lua_pushstring(L, err);
+    else lua_pushnil(L);
+    if (lua_pcall(L, 4, 0, 0) != 0) lua_pop(L, 1);
+}
+
+/** Sends as much of the file as the fd takes. Returns 1 when it's all sent,
+ * 0 when the socket buffer is full, or -1 with errno set (to 0 if the file
+ * ended early).
+ **/
+static int sendFile(snFileExt *ext, int fd) {
+    while (ext->sendleft > 0) {
+        size_t len = ext->sendleft < (1 << 30) ? ext->sendleft : (1 << 30);
+#ifdef HAVE_SENDFILE
+        ssize_t n = sendfile(fd, ext->sendfd, &ext->sendoffset, len);
+#else
+        char buf[65536];
+        ssize_t n = pread(ext->sendfd, buf, len < sizeof(buf) ? len : sizeof(buf), ext->sendoffset);
+        if (n > 0) {
+            n = write(fd, buf, n);
+            if (n > 0) ext->sendoffset += n;
+        }
+#endif
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) {
+            errno = 0;
+            return -1;
+        }
+        ext->sendleft -= n;
+        ext->sent += n;
+    }
+    
+    return 1;
+}
+
+/** Writes as much of the queue as the fd takes, with the file of a
+ * loop:sendfile in its place. Fires the "drain" callback when the queue
+ * shrinks to the low watermark, with an error message as the third argument
+ * if the write failed (the queue is discarded then).
+ **/
+static void flushQueue(lua_State *L, snHopLoop *hloop, int fd) {
+    snFileExt *ext = hloop->exts[fd];
+    size_t before = ext->queued;
+    struct iovec iov[SN_IOV_MAX];
+    
+    for (;;) {
+        if (ext->sending && ext->sendahead == 0) {
+            int done = sendFile(ext, fd);
+            if (done == 0) break;
+            
+            /* the callback may write more, or discard the fd */
+            if (done == 1 || errno == 0) {
+                finishSendfile(L, ext, fd, done == 1 ? NULL : "Unexpected end of file.");
+                if (!(ext = hloop->exts[fd])) return;
+                continue;
+            }
+            
+            lua_pushstring(L, strerror(errno));
+            finishSendfile(L, ext, fd, lua_tostring(L, -1));
+            if ((ext = hloop->exts[fd])) {
+                discardQueue(L, hloop, fd);
+                if (ext->drain != LUA_NOREF) run_queueCallback(L, ext, ext->drain, fd);
+            }
+            lua_pop(L, 1);
+            return;
+        }
+        if (ext->count == 0) break;
+        
+        int i, n = ext->count < SN_IOV_MAX ? ext->count : SN_IOV_MAX;
+        if (ext->sending && ext->sendahead < n) n = ext->sendahead;
+        size_t total = 0;
+        
+        for (i = 0; i < n; i++) {
+            snWriteChunk *chunk = &ext->chunks[(ext->head + i) % ext->capacity];
+            iov[i].iov_base = (void *) chunk->data;
+            iov[i].iov_len = chunk->len;
+            total += chunk->len;
+        }
+        
+        ssize_t written = writev(fd, iov, n);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            
+            lua_pushstring(L, strerror(errno));
+            if (ext->sending) finishSendfile(L, ext, fd, lua_tostring(L, -1));
+            if ((ext = hloop->exts[fd])) {
+                discardQueue(L, hloop, fd);
+                if (ext->drain != LUA_NOREF) run_queueCallback(L, ext, ext->drain, fd);
+            }
+            lua_pop(L, 1);
+            return;
+        }
+        
+        size_t left = written;
+        ext->queued -= left;
+        while (left > 0) {
+            snWriteChunk *chunk = &ext->chunks[ext->head];
+            if (left < chunk->len) {
+                chunk->data += left;
+                chunk->len -= left;
+                break;
+            }
+            left -= chunk->len;
+            luaL_unref(L, LUA_ENVIRONINDEX, chunk->ref);
+            ext->head = (ext->head + 1) % ext->capacity;
+            ext->count--;
+            if (ext->sending) ext->sendahead--;
+        }
+        
+        if ((size_t) written < total) break; /* the socket buffer is full */
+    }
+    
+    if (ext->count == 0 && !ext->sending) {
+        ext->head = 0;
+        clearMask(hloop, fd, SN_WQUEUE);
+    }
+    if (ext->drain != LUA_NOREF && before > ext->low && ext->queued <= ext->low) {
+        lua_pushnil(L);
+        run_queueCallback(L, ext, ext->drain, fd);
+        lua_pop(L, 1);
+    }
+}
+
+/** loop:write(fd, data)
+ * Returns the number of bytes left in the queue, or nil and an error message.
+ **/
+static int hop_write(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int fd = luaL_checknumber(L, 2);
+    size_t len;
+    const char *data = luaL_checklstring(L, 3, &len);
+    size_t done = 0;
+    
+    if (growEvents(hloop, fd) == -1) {
+        return luaL_error(L, "File descriptor outside RLIMIT_NOFILE");
+    }
+    
+    /* checked before anything is written: once some bytes went out, the
+     rest has to be queued, or the caller would write them twice */
+    snFileExt *ext = hloop->exts[fd];
+    if (ext && ext->max && ext->queued + len > ext->max) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Write queue is full.");
+        return 2;
+    }
+    if (!ext || (ext->count == 0 && !ext->sending)) {
+        ssize_t n;
+        do {
+            n = write(fd, data, len);
+        } while (n == -1 && errno == EINTR);
+        
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+        if (n > 0) done = n;
+        if (done == len) {
+            lua_pushnumber(L, ext ? ext->queued : 0);
+            return 1;
+        }
+    }
+    
+    ext = getFileExt(hloop, fd);
+    if (!ext) return luaL_error(L, "Could not allocate write queue.");
+    
+    size_t before = ext->queued;
+    lua_pushvalue(L, 3);
+    int ref = luaL_ref(L, LUA_ENVIRONINDEX);
+    if (pushChunk(ext, data + done, len - done, ref) == -1) {
+        luaL_unref(L, LUA_ENVIRONINDEX, ref);
+        return luaL_error(L, "Could not allocate write queue.");
+    }
+    
+    if (!(hloop->events[fd].mask & SN_WQUEUE)) {
+        if (hloop->api->addEvent(hloop, fd, SN_WQUEUE) == -1) {
+            discardQueue(L, hloop, fd);
+            return luaL_error(L, "Could not add event listener.");
+        }
+        hloop->events[fd].mask |= SN_WQUEUE;
+    }
+    if (ext->highwater != LUA_NOREF && ext->high && before <= ext->high && ext->queued > ext->high) {
+        lua_pushnumber(L, ext->queued);
+        run_queueCallback(L, ext, ext->highwater, fd);
+        lua_pop(L, 1);
+    }
+    
+    lua_pushnumber(L, ext->queued);
+    return 1;
+}
+
+/** loop:sendfile(outfd, infd, offset, len, fn)
+ * Sends 'len' bytes (nil: up to the end) of the file 'infd' from 'offset',
+ * after the data queued by loop:write, without copying it through Lua. It
+ * starts when 'outfd' becomes writable. fn(loop, outfd, sent, err) is called
+ * once, when it's done or failed. Later writes go after the file.
+ **/
+static int hop_sendfile(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int fd = luaL_checknumber(L, 2);
+    int infd = luaL_checknumber(L, 3);
+    off_t offset = luaL_optnumber(L, 4, 0);
+    luaL_checktype(L, 6, LUA_TFUNCTION);
+    lua_settop(L, 6);
+    
+    size_t len;
+    if (lua_isnil(L, 5)) {
+        struct stat st;
+        if (fstat(infd, &st) == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+        len = st.st_size > offset ? st.st_size - offset : 0;
+    } else {
+        len = luaL_checknumber(L, 5);
+    }
+    
+    if (growEvents(hloop, fd) == -1) {
+        return luaL_error(L, "File descriptor outside RLIMIT_NOFILE");
+    }
+    snFileExt *ext = getFileExt(hloop, fd);
+    if (!ext) return luaL_error(L, "Could not allocate write queue.");
+    if (ext->sending) return luaL_error(L, "A file is being sent already.");
+    
+    if (!(hloop->events[fd].mask & SN_WQUEUE)) {
+        if (hloop->api->addEvent(hloop, fd, SN_WQUEUE) == -1) {
+            return luaL_error(L, "Could not add event listener.");
+        }
+        hloop->events[fd].mask |= SN_WQUEUE;
+    }
+    ext->sending = 1;
+    ext->sendfd = infd;
+    ext->sendahead = ext->count;
+    ext->sendoffset = offset;
+    ext->sendleft = len;
+    ext->sent = 0;
+    ext->sendcallback = luaL_ref(L, LUA_ENVIRONINDEX);
+    
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static void setQueueCallback(lua_State *L, int *ref, const char *name) {
+    lua_getfield(L, 3, name);
+    if (lua_isfunction(L, -1)) {
+        luaL_unref(L, LUA_ENVIRONINDEX, *ref);
+        *ref = luaL_ref(L, LUA_ENVIRONINDEX);
+    } else {
+        lua_pop(L, 1);
+    }
+}
+
+static size_t getQueueSize(lua_State *L, const char *name, size_t def) {
+    lua_getfield(L, 3, name);
+    size_t size = lua_isnumber(L, -1) ? (size_t) lua_tonumber(L, -1) : def;
+    lua_pop(L, 1);
+    
+    return size;
+}
+
+/** loop:buffer([size])
+ * Returns a buffer of at least 'size' bytes (4 KiB), which grows as needed.
+ * Its memory comes from (and goes back to) the slab pool of the loop.
+ **/
+static int hop_buffer(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    lua_Integer size = luaL_optinteger(L, 2, 0);
+    if (size < 0) return luaL_error(L, "Invalid size.");
+    
+    if (!hloop->buffers && !(hloop->buffers = snBufferPoolCreate())) {
+        return luaL_error(L, "Could not allocate a buffer.");
+    }
+    if (!snPushBuffer(L, hloop->buffers, size)) {
+        return luaL_error(L, "Could not allocate a buffer.");
+    }
+    
+    return 1;
+}
+
+#define SN_SPILL_SIZE 65536
+
+/** loop:readinto(fd, buf)
+ * Appends what 'fd' has to the buffer, with one readv into the free space of
+ * the buffer and a stack buffer for the rest, so a big read doesn't need a
+ * second call. Returns the number of bytes read (0 at the end of the stream),
+ * or nil and an error message ("again" if it would block).
+ **/
+static int hop_readInto(lua_State *L) {
+    checkLoop(L);
+    int fd = luaL_checknumber(L, 2);
+    snBuffer *buf = snCheckBuffer(L, 3);
+    char spill[SN_SPILL_SIZE];
+    struct iovec iov[2];
+    ssize_t n;
+    
+    if (snBufferReserve(buf, 1) == -1) return luaL_error(L, "Out of memory.");
+    size_t room = buf->size - buf->start - buf->len;
+    iov[0].iov_base = buf->data + buf->start + buf->len;
+    iov[0].iov_len = room;
+    iov[1].iov_base = spill;
+    iov[1].iov_len = sizeof(spill);
+    
+    do {
+        n = readv(fd, iov, 2);
+    } while (n == -1 && errno == EINTR);
+    
+    if (n == -1) {
+        lua_pushnil(L);
+        if (errno == EAGAIN || errno == EWOULDBLOCK) lua_pushliteral(L, "again");
+        else lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    
+    if ((size_t) n <= room) {
+        buf->len += n;
+    } else {
+        buf->len += room;
+        if (snBufferReserve(buf, n - room) == -1) return luaL_error(L, "Out of memory.");
+        memcpy(buf->data + buf->start + buf->len, spill, n - room);
+        buf->len += n - room;
+    }
+    lua_pushnumber(L, n);
+    
+    return 1;
+}
+
+/** loop:writeopts(fd, {high=bytes, low=bytes, max=bytes, drain=fn, highwater=fn})
+ * drain(loop, fd, err) - the queue shrank from over 'low' to 'low' bytes
+ * highwater(loop, fd, queued) - the queue grew over 'high' bytes
+ **/
+static int hop_writeOpts(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int fd = luaL_checknumber(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    
+    if (growEvents(hloop, fd) == -1) {
+        return luaL_error(L, "File descriptor outside RLIMIT_NOFILE");
+    }
+    snFileExt *ext = getFileExt(hloop, fd);
+    if (!ext) return luaL_error(L, "Could not allocate write queue.");
+    
+    ext->L = L;
+    ext->high = getQueueSize(L, "high", ext->high);
+    ext->low = getQueueSize(L, "low", ext->low);
+    ext->max = getQueueSize(L, "max", ext->max);
+    setQueueCallback(L, &ext->drain, "drain");
+    setQueueCallback(L, &ext->highwater, "highwater");
+    
+    return 0;
+}
+
+/** loop:discard(fd)
+ * Drops the write queue of 'fd' together with its options. Call it before
+ * closing a descriptor, which still may have queued data. Other state of
+ * the fd (a deadline, a native handler) is kept.
+ **/
+static int hop_discard(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int fd = luaL_checknumber(L, 2);
+    
+    if (fd < 0 || fd >= hloop->setsize || !hloop->exts[fd]) return 0;
+    snFileExt *ext = hloop->exts[fd];
+    
+    discardQueue(L, hloop, fd);
+    luaL_unref(L, LUA_ENVIRONINDEX, ext->drain);
+    luaL_unref(L, LUA_ENVIRONINDEX, ext->highwater);
+    ext->drain = LUA_NOREF;
+    ext->highwater = LUA_NOREF;
+    ext->high = 0;
+    ext->low = 0;
+    ext->max = 0;
+    
+    /* the ext is still needed by the handler of a native fd and by a deadline */
+    if (!(hloop->events[fd].mask & SN_NATIVE) && hloop->events[fd].deadline == 0) {
+        freeFileExt(L, hloop, fd);
+    }
+    
+    return 0;
+}
+
+/** Returns the slack_ms field of the time table at 'tidx', or the default
+ * slack of the loop.
+ **/
+static int getSlack(lua_State *L, snHopLoop *hloop, int tidx) {
+    lua_getfield(L, tidx, "slack_ms");
+    int slack = lua_isnumber(L, -1) ? (int) lua_tonumber(L, -1) : hloop->slack;
+    lua_pop(L, 1);
+    
+    return slack > 0 ? slack : 0;
+}
+
+static int _setTimer(lua_State *L, int timerType) {
+    snHopLoop *hloop = checkLoop(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (! lua_isfunction(L, 3)) return luaL_error(L, "Function was expexted.");
+    int fd = 0;
+    
+    struct timeval tv;
+    double usec_total = table_to_usec(L, 2);
+    
+    tv.tv_sec = (long int) (usec_total / SIM);
+    tv.tv_usec = (long int) fmod(usec_total, SIM);
+    
+    int slack = getSlack(L, hloop, 2);
+    int clbref = luaL_ref(L, LUA_ENVIRONINDEX);
+    
+    if (timerType & SN_ONCE)
+        fd = hloop->api->setTimeout(hloop, &tv, slack);
+    else
+        fd = hloop->api->setInterval(hloop, &tv, slack);
+    
+    if (fd != -1 && growTimers(hloop, fd) == -1) {
+        hloop->api->clearTimer(hloop, fd);
+        fd = -1;
+    }
+    
+    if (fd == -1) {
+        lua_pushnumber(L, -1);
+        lua_pushstring(L, "Could not create a new timer (internal error)");
+        
+        releaseRef(L, clbref);
+        
+        return 2;
+    }
+    
+    hloop->timers[fd].L = L;
+    hloop->timers[fd].callback = clbref;
+    hloop->timers[fd].mask = SN_TIMER;
+    if (timerType & SN_ONCE) hloop->timers[fd].mask |= SN_ONCE;
+    
+    lua_pushnumber(L, fd);
+    
+    return 1;
+}
+
+static int hop_setTimeout(lua_State *L) {
+    return _setTimer(L, SN_ONCE);
+}
+
+static int hop_setInterval(lua_State *L) {
+    return _setTimer(L, 0);
+}
+
+static int _clearTimer(lua_State *L, snHopLoop *hloop, int fd) {
+    if (fd < 0 || fd >= hloop->timersize) return 0;
+    if (hloop->timers[fd].mask == SN_NONE) return 0;
+    hloop->timers[fd].mask = SN_NONE;
+    
+    hloop->api->clearTimer(hloop, fd);
+    
+    releaseRef(L, hloop->timers[fd].callback);
+    hloop->timers[fd].callback = LUA_NOREF;
+    
+    return 0;
+}
+
+/** loop:slack([ms])
+ * Sets the default slack of new timers, which may fire up to 'ms'
+ * milliseconds late, so that timers due around the same time fire together.
+ * A slack_ms field in the time table overrides it. Returns the old value.
+ **/
+static int hop_slack(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int slack = hloop->slack;
+    
+    if (!lua_isnoneornil(L, 2)) {
+        int ms = luaL_checknumber(L, 2);
+        if (ms < 0) return luaL_error(L, "Invalid slack.");
+        hloop->slack = ms;
+    }
+    lua_pushnumber(L, slack);
+    
+    return 1;
+}
+
+static int hop_clearTimer(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int fd = luaL_checknumber(L, 2);
+    
+    return _clearTimer(L, hloop, fd);
+}
+
+/* Signals.
+ * All the signals watched by a loop share one signalfd, which is polled like
+ * any other fd, but handled in C (SN_NATIVE). Watched signals are blocked in
+ * the calling thread, so they are only delivered through the signalfd. */
+
+#ifdef HAVE_SIGNALFD
+static const char* signal_names[] = {"HUP", "INT", "QUIT", "TERM", "CHLD", "USR1",
+                                     "USR2", "PIPE", "ALRM", "WINCH", "CONT", NULL};
+static const int signal_numbers[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGCHLD, SIGUSR1,
+                                     SIGUSR2, SIGPIPE, SIGALRM, SIGWINCH, SIGCONT};
+
+#define SN_NSIG 65 /* signal numbers go up to SIGRTMAX (64) on Linux */
+
+typedef struct snSignals {
+    int fd;
+    sigset_t mask;
+    int callbacks[SN_NSIG]; /* Indexed by signal number; LUA_NOREF if not watched */
+} snSignals;
+
+/** Returns the signal number for a number or a name ("TERM" or "SIGTERM"),
+ * or -1.
+ **/
+static int getSignal(lua_State *L, int idx) {
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        int sig = lua_tonumber(L, idx);
+        return (sig > 0 && sig < SN_NSIG) ? sig : -1;
+    }
+    
+    const char *name = luaL_checkstring(L, idx);
+    const char *n;
+    int i = 0;
+    
+    if (strncmp(name, "SIG", 3) == 0) name += 3;
+    while ((n = signal_names[i])) {
+        if (strcmp(name, n) == 0) return signal_numbers[i];
+        i++;
+    }
+    
+    return -1;
+}
+
+/* snNativeHandler of the signalfd */
+static void handleSignals(lua_State *L, snHopLoop *hloop, int fd, int mask) {
+    struct signalfd_siginfo info[16];
+    ssize_t n;
+    (void) mask;
+    
+    while ((n = read(fd, info, sizeof(info))) > 0) {
+        int i, count = n / sizeof(struct signalfd_siginfo);
+        
+        for (i = 0; i < count; i++) {
+            int sig = info[i].ssi_signo;
+            /* a callback may remove the watchers */
+            if (!hloop->signals || sig >= SN_NSIG) return;
+            if (hloop->signals->callbacks[sig] == LUA_NOREF) continue;
+            
+            lua_rawgeti(L, LUA_ENVIRONINDEX, hloop->signals->callbacks[sig]);
+            lua_pushvalue(L, 1);
+            lua_pushnumber(L, sig);
+            if (lua_pcall(L, 2, 0, 0) != 0) lua_pop(L, 1);
+        }
+    }
+}
+
+static snSignals *openSignals(lua_State *L, snHopLoop *hloop) {
+    snSignals *signals = malloc(sizeof(snSignals));
+    (void) L;
+    if (!signals) return NULL;
+    
+    int i;
+    sigemptyset(&signals->mask);
+    for (i = 0; i < SN_NSIG; i++) signals->callbacks[i] = LUA_NOREF;
+    
+    signals->fd = signalfd(-1, &signals->mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signals->fd == -1) {
+        free(signals);
+        return NULL;
+    }
+    
+    int fd = signals->fd;
+    snFileExt *ext = growEvents(hloop, fd) == -1 ? NULL : getFileExt(hloop, fd);
+    if (!ext || hloop->api->addEvent(hloop, fd, SN_READABLE) == -1) {
+        close(fd);
+        free(signals);
+        return NULL;
+    }
+    ext->handler = handleSignals;
+    hloop->events[fd].mask |= SN_READABLE | SN_NATIVE;
+    hloop->signals = signals;
+    
+    return signals;
+}
+
+static void freeSignals(lua_State *L, snHopLoop *hloop) {
+    snSignals *signals = hloop->signals;
+    if (!signals) return;
+    
+    clearMask(hloop, signals->fd, SN_READABLE | SN_NATIVE);
+    freeFileExt(L, hloop, signals->fd);
+    close(signals->fd);
+    pthread_sigmask(SIG_UNBLOCK, &signals->mask, NULL);
+    free(signals);
+    hloop->signals = NULL;
+}
+
+/** loop:onsignal(signal, fn)
+ * Calls fn(loop, signal) when the signal (a number, or a name like "TERM")
+ * arrives; a nil fn stops watching it. Signals of the same kind which
+ * arrive together are reported once (e.g. SIGCHLD for many children).
+ **/
+static int hop_onSignal(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int sig = getSignal(L, 2);
+    if (sig == -1) return luaL_error(L, "Invalid signal.");
+    if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TFUNCTION);
+    lua_settop(L, 3);
+    
+    snSignals *signals = hloop->signals;
+    if (!signals && lua_isnil(L, 3)) return 0;
+    if (!signals && !(signals = openSignals(L, hloop))) {
+        return luaL_error(L, "Could not create a signalfd.");
+    }
+    
+    sigset_t one;
+    sigemptyset(&one);
+    sigaddset(&one, sig);
+    luaL_unref(L, LUA_ENVIRONINDEX, signals->callbacks[sig]);
+    signals->callbacks[sig] = LUA_NOREF;
+    
+    if (lua_isnil(L, 3)) {
+        sigdelset(&signals->mask, sig);
+        signalfd(signals->fd, &signals->mask, 0);
+        pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+        return 0;
+    }
+    
+    sigaddset(&signals->mask, sig);
+    if (pthread_sigmask(SIG_BLOCK, &one, NULL) != 0 ||
+        signalfd(signals->fd, &signals->mask, 0) == -1) {
+        sigdelset(&signals->mask, sig);
+        return luaL_error(L, "Could not watch signal %d.", sig);
+    }
+    signals->callbacks[sig] = luaL_ref(L, LUA_ENVIRONINDEX);
+    
+    return 0;
+}
+#else
+static void freeSignals(lua_State *L, snHopLoop *hloop) {
+    (void) L;
+    (void) hloop;
+}
+
+static int hop_onSignal(lua_State *L) {
+    return luaL_error(L, "loop:onsignal needs signalfd (Linux).");
+}
+#endif
+
+/* Inbox.
+ * Other threads post messages to the inbox of a loop; the first message of a
+ * batch writes to the eventfd of the inbox, which is polled like a signalfd
+ * (SN_NATIVE). The loop drains the whole batch into one callback. */
+
+/* snNativeHandler of the inbox eventfd */
+static void handleInbox(lua_State *L, snHopLoop *hloop, int fd, int mask) {
+    (void) fd;
+    (void) mask;
+    lua_rawgeti(L, LUA_ENVIRONINDEX, hloop->inboxcallback);
+    lua_pushvalue(L, 1);
+    if (snInboxDrain(L, hloop->inbox) == 0) {
+        lua_pop(L, 3);
+        return;
+    }
+    if (lua_pcall(L, 2, 0, 0) != 0) lua_pop(L, 1);
+}
+
+static void freeInbox(lua_State *L, snHopLoop *hloop) {
+    if (!hloop->inbox) return;
+    
+    int fd = snInboxFd(hloop->inbox);
+    clearMask(hloop, fd, SN_READABLE | SN_NATIVE);
+    freeFileExt(L, hloop, fd);
+    snInboxClose(hloop->inbox);
+    hloop->inbox = NULL;
+}
+
+/** loop:inbox(name, fn[, capacity])
+ * Creates the inbox of the loop, named 'name' in the whole process, which
+ * holds up to 'capacity' (1024) messages. fn(loop, messages) gets the posted
+ * messages in order, as an array. Returns a handle for posting; other
+ * threads open one with luahop.inbox(name).
+ **/
+static int hop_inbox(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    const char *name = luaL_checkstring(L, 2);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    int capacity = luaL_optnumber(L, 4, SN_INBOX_CAPACITY);
+    lua_settop(L, 3);
+    
+    if (hloop->inbox) return luaL_error(L, "The loop has an inbox already.");
+    if (capacity < 1) return luaL_error(L, "Invalid capacity.");
+    
+    snInbox *inbox = snInboxCreate(name, capacity);
+    if (!inbox) return luaL_error(L, "Could not create inbox '%s'.", name);
+    
+    int fd = snInboxFd(inbox);
+    snFileExt *ext = growEvents(hloop, fd) == -1 ? NULL : getFileExt(hloop, fd);
+    if (!ext || hloop->api->addEvent(hloop, fd, SN_READABLE) == -1) {
+        snInboxClose(inbox);
+        return luaL_error(L, "Could not create inbox '%s'.", name);
+    }
+    ext->handler = handleInbox;
+    hloop->events[fd].mask |= SN_READABLE | SN_NATIVE;
+    hloop->inbox = inbox;
+    hloop->inboxcallback = luaL_ref(L, LUA_ENVIRONINDEX);
+    
+    snPushInbox(L, inbox);
+    
+    return 1;
+}
+
+/* Deadlines.
+ * A deadline lives in the event slot of its fd, so loop:touch only stores a
+ * new time: no syscall, no allocation. Fds are linked into a ring of coarse
+ * buckets by the deadline they had when linked. Once per iteration, the
+ * buckets of elapsed ticks are checked: fds whose deadline passed expire,
+ * touched ones are linked again into the bucket of their new deadline.
+ * Deadlines beyond the ring go round it the same way. */
+
+#define SN_DEADLINE_TICK 100000000ULL /* ns per bucket; deadlines fire up to that late */
+#define SN_DEADLINE_BUCKETS 512 /* The ring covers 51.2 s */
+#define SN_DEADLINE_EXPIRED SN_DEADLINE_BUCKETS /* List of expired fds */
+
+static void linkDeadline(snHopLoop *hloop, int fd, int slot) {
+    snFileExt *ext = hloop->exts[fd];
+    
+    ext->dlslot = slot;
+    ext->dlprev = -1;
+    ext->dlnext = hloop->deadlines[slot];
+    if (ext->dlnext != -1) hloop->exts[ext->dlnext]->dlprev = fd;
+    hloop->deadlines[slot] = fd;
+}
+
+static void linkDeadlineTick(snHopLoop *hloop, int fd) {
+    unsigned long long tick = hloop->events[fd].deadline / SN_DEADLINE_TICK;
+    
+    if (tick < hloop->dltick) hloop->dltick = tick;
+    linkDeadline(hloop, fd, tick % SN_DEADLINE_BUCKETS);
+}
+
+static void unlinkDeadline(snHopLoop *hloop, int fd) {
+    snFileExt *ext = hloop->exts[fd];
+    
+    if (ext->dlprev != -1) hloop->exts[ext->dlprev]->dlnext = ext->dlnext;
+    else hloop->deadlines[ext->dlslot] = ext->dlnext;
+    if (ext->dlnext != -1) hloop->exts[ext->dlnext]->dlprev = ext->dlprev;
+    ext->dlnext = -1;
+    ext->dlprev = -1;
+}
+
+static void clearDeadline(lua_State *L, snHopLoop *hloop, int fd) {
+    if (hloop->events[fd].deadline == 0) return;
+    
+    snFileExt *ext = hloop->exts[fd];
+    unlinkDeadline(hloop, fd);
+    hloop->events[fd].deadline = 0;
+    hloop->ndeadlines--;
+    luaL_unref(L, LUA_ENVIRONINDEX, ext->dlcallback);
+    ext->dlcallback = LUA_NOREF;
+}
+
+/** Shortens the wait of a poll ('*tsp', NULL for no limit) so it ends with
+ * the earliest tick which has deadlines.
+ **/
+static void limitWait(snHopLoop *hloop, struct timespec *ts, struct timespec **tsp) {
+    if (hloop->ndeadlines == 0) return;
+    
+    unsigned long long due = (hloop->dltick + 1) * SN_DEADLINE_TICK;
+    unsigned long long now = snNanoTime();
+    unsigned long long wait = due > now ? due - now : 0;
+    
+    if (*tsp && (unsigned long long) (*tsp)->tv_sec * 1000000000ULL + (*tsp)->tv_nsec <= wait) {
+        return;
+    }
+    ts->tv_sec = wait / 1000000000ULL;
+    ts->tv_nsec = wait % 1000000000ULL;
+    *tsp = ts;
+}
+
+/** Checks the buckets of the ticks which elapsed and calls fn(loop, fd) for
+ * the expired fds.
+ **/
+static void expireDeadlines(lua_State *L, snHopLoop *hloop) {
+    unsigned long long now = hloop->now;
+    unsigned long long tick = now / SN_DEADLINE_TICK;
+    int n, fd;
+    
+    /* expired fds are moved to their own list first, because callbacks
+     may change any deadline */
+    for (n = 0; hloop->dltick < tick && n < SN_DEADLINE_BUCKETS; n++) {
+        int slot = hloop->dltick % SN_DEADLINE_BUCKETS;
+        fd = hloop->deadlines[slot];
+        hloop->deadlines[slot] = -1;
+        hloop->dltick++;
+        
+        while (fd != -1) {
+            int next = hloop->exts[fd]->dlnext;
+            if (hloop->events[fd].deadline <= now) linkDeadline(hloop, fd, SN_DEADLINE_EXPIRED);
+            else linkDeadlineTick(hloop, fd);
+            fd = next;
+        }
+    }
+    /* every bucket was checked */
+    if (hloop->dltick < tick) hloop->dltick = tick;
+    
+    while ((fd = hloop->deadlines[SN_DEADLINE_EXPIRED]) != -1) {
+        snFileExt *ext = hloop->exts[fd];
+        int ref = ext->dlcallback;
+        
+        unlinkDeadline(hloop, fd);
+        hloop->events[fd].deadline = 0;
+        hloop->ndeadlines--;
+        ext->dlcallback = LUA_NOREF;
+        
+        lua_rawgeti(L, LUA_ENVIRONINDEX, ref);
+        luaL_unref(L, LUA_ENVIRONINDEX, ref);
+        lua_pushvalue(L, 1);
+        lua_pushnumber(L, fd);
+        if (lua_pcall(L, 2, 0, 0) != 0) lua_pop(L, 1);
+    }
+    
+    /* skip empty buckets, so the poll doesn't wake up for them */
+    for (n = 0; hloop->ndeadlines > 0 && n < SN_DEADLINE_BUCKETS; n++) {
+        if (hloop->deadlines[hloop->dltick % SN_DEADLINE_BUCKETS] != -1) break;
+        hloop->dltick++;
+    }
+}
+
+/** loop:setdeadline(fd, timeout, fn)
+ * Calls fn(loop, fd) once, when 'fd' wasn't touched (see loop:touch) for
+ * 'timeout', e.g. {s=30}. Deadlines are checked in buckets of 100 ms, so fn
+ * may run that much late. A nil timeout removes the deadline.
+ **/
+static int hop_setDeadline(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int fd = luaL_checknumber(L, 2);
+    
+    if (growEvents(hloop, fd) == -1) {
+        return luaL_error(L, "File descriptor outside RLIMIT_NOFILE");
+    }
+    if (lua_isnoneornil(L, 3)) {
+        clearDeadline(L, hloop, fd);
+        return 0;
+    }
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+    double usec = table_to_usec(L, 3);
+    if (usec < 0) usec = 0;
+    lua_settop(L, 4);
+    
+    if (!hloop->deadlines) {
+        int i;
+        hloop->deadlines = malloc(sizeof(int) * (SN_DEADLINE_BUCKETS + 1));
+        if (!hloop->deadlines) return luaL_error(L, "Out of memory.");
+        for (i = 0; i <= SN_DEADLINE_BUCKETS; i++) hloop->deadlines[i] = -1;
+    }
+    snFileExt *ext = getFileExt(hloop, fd);
+    if (!ext) return luaL_error(L, "Out of memory.");
+    
+    clearDeadline(L, hloop, fd);
+    ext->dltimeout = (unsigned long long) (usec * 1000);
+    ext->dlcallback = luaL_ref(L, LUA_ENVIRONINDEX);
+    hloop->events[fd].deadline = snNanoTime() + ext->dltimeout;
+    if (hloop->ndeadlines++ == 0) hloop->dltick = hloop->events[fd].deadline / SN_DEADLINE_TICK;
+    linkDeadlineTick(hloop, fd);
+    
+    return 0;
+}
+
+/** loop:touch(fd)
+ * Moves the deadline of 'fd' to 'timeout' from now. Does nothing if the fd
+ * has no deadline.
+ **/
+static int hop_touch(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int fd = luaL_checknumber(L, 2);
+    
+    if (fd >= 0 && fd < hloop->setsize && hloop->exts[fd] && hloop->events[fd].deadline != 0) {
+        /* the clock is read again, as loop:setdeadline does: with the time of
+         the iteration, a touch could move the deadline before the bucket
+         the fd is linked in, and it would expire that much late */
+        unsigned long long deadline = snNanoTime() + hloop->exts[fd]->dltimeout;
+        
+        assert(deadline >= hloop->events[fd].deadline);
+        hloop->events[fd].deadline = deadline;
+    }
+    
+    return 0;
+}
+
+/* Deferred functions and hooks.
+ * An iteration of hop_poll runs: idle hooks, prepare hooks, the poll, the
+ * fired events, check hooks and the functions deferred before the
+ * iteration ran them. The poll doesn't block while there are deferred
+ * functions or idle hooks. Everything is called as fn(loop). */
+
+static int pushCallbackRef(snCallbackList *list, int ref) {
+    if (list->count == list->size) {
+        int size = list->size ? list->size * 2 : 8;
+        int *refs = realloc(list->refs, sizeof(int) * size);
+        if (!refs) return -1;
+        list->refs = refs;
+        list->size = size;
+    }
+    list->refs[list->count++] = ref;
+    
+    return 0;
+}
+
+/** Drops the first 'n' entries and the ones marked as removed.
+ **/
+static void compactCallbacks(snCallbackList *list, int n) {
+    int i, count = 0;
+    
+    for (i = n; i < list->count; i++) {
+        if (list->refs[i] != LUA_NOREF) list->refs[count++] = list->refs[i];
+    }
+    list->count = count;
+    list->removed = 0;
+}
+
+static void call_loopCallback(lua_State *L, int clbref) {
+    lua_rawgeti(L, LUA_ENVIRONINDEX, clbref);
+    lua_pushvalue(L, 1);
+    if (lua_pcall(L, 1, 0, 0) != 0) lua_pop(L, 1);
+}
+
+/** Runs the hooks, which were there when it started.
+ **/
+static void runHooks(lua_State *L, snCallbackList *hooks) {
+    int i, n = hooks->count;
+    
+    for (i = 0; i < n; i++) {
+        if (hooks->refs[i] != LUA_NOREF) call_loopCallback(L, hooks->refs[i]);
+    }
+    if (hooks->removed) compactCallbacks(hooks, 0);
+}
+
+/** Runs the functions deferred before it started; the ones they defer
+ * wait for the next iteration.
+ **/
+static void runDeferred(lua_State *L, snHopLoop *hloop) {
+    snCallbackList *deferred = &hloop->deferred;
+    int i, n = deferred->count;
+    
+    for (i = 0; i < n; i++) {
+        int clbref = deferred->refs[i];
+        deferred->refs[i] = LUA_NOREF;
+        
+        lua_rawgeti(L, LUA_ENVIRONINDEX, clbref);
+        luaL_unref(L, LUA_ENVIRONINDEX, clbref);
+        lua_pushvalue(L, 1);
+        if (lua_pcall(L, 1, 0, 0) != 0) lua_pop(L, 1);
+    }
+    if (n > 0) compactCallbacks(deferred, n);
+}
+
+/** loop:defer(fn)
+ * Runs fn(loop) at the end of the current (or the next) loop iteration.
+ **/
+static int hop_defer(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    
+    lua_settop(L, 2);
+    int clbref = luaL_ref(L, LUA_ENVIRONINDEX);
+    if (pushCallbackRef(&hloop->deferred, clbref) == -1) {
+        luaL_unref(L, LUA_ENVIRONINDEX, clbref);
+        return luaL_error(L, "Could not defer a function.");
+    }
+    
+    return 0;
+}
+
+static int _addHook(lua_State *L, snCallbackList *hooks) {
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    
+    lua_settop(L, 2);
+    int clbref = luaL_ref(L, LUA_ENVIRONINDEX);
+    if (pushCallbackRef(hooks, clbref) == -1) {
+        luaL_unref(L, LUA_ENVIRONINDEX, clbref);
+        return luaL_error(L, "Could not add a hook.");
+    }
+    lua_pushnumber(L, clbref);
+    
+    return 1;
+}
+
+/** loop:idle(fn), loop:prepare(fn), loop:check(fn)
+ * Return an id for loop:rmhook(id).
+ **/
+static int hop_idle(lua_State *L) {
+    return _addHook(L, &(checkLoop(L))->idle);
+}
+
+static int hop_prepare(lua_State *L) {
+    return _addHook(L, &(checkLoop(L))->prepare);
+}
+
+static int hop_check(lua_State *L) {
+    return _addHook(L, &(checkLoop(L))->check);
+}
+
+static int hop_removeHook(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int clbref = luaL_checknumber(L, 2);
+    snCallbackList *lists[] = {&hloop->idle, &hloop->prepare, &hloop->check};
+    int i, j;
+    
+    for (i = 0; i < 3; i++) {
+        snCallbackList *hooks = lists[i];
+        for (j = 0; j < hooks->count; j++) {
+            if (hooks->refs[j] != clbref) continue;
+            
+            /* the list may be running; it's compacted afterwards */
+            hooks->refs[j] = LUA_NOREF;
+            hooks->removed++;
+            luaL_unref(L, LUA_ENVIRONINDEX, clbref);
+            lua_pushboolean(L, 1);
+            return 1;
+        }
+    }
+    lua_pushboolean(L, 0);
+    
+    return 1;
+}
+
+/* Coroutines.
+ * loop:wait() and loop:sleep() suspend the running coroutine; hop_poll
+ * resumes it directly, so no callback closure is needed. A reference to the
+ * coroutine takes the place of the callback reference. After a wait, the fd
+ * stays registered until the resumed coroutine yields again, so waiting on
+ * the same fd in a loop doesn't change the kernel interest every time. */
+
+/** loop:wait(fd, mode)
+ * Suspends the running coroutine until 'fd' is ready for 'mode' ("r", "w"
+ * or "rw"). Returns fd and the mode it's ready for.
+ **/
+static int hop_wait(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int fd = luaL_checknumber(L, 2);
+    int mask = getMask(luaL_checkstring(L, 3));
+    if (mask == -1 || !(mask & SN_POLLED)) return luaL_error(L, "Invalid event mask.");
+    
+    if (growEvents(hloop, fd) == -1) {
+        return luaL_error(L, "File descriptor outside RLIMIT_NOFILE");
+    }
+    
+    snFileEvent *evData = &hloop->events[fd];
+    if (((mask & SN_READABLE) && evData->rcallback != LUA_NOREF) ||
+        ((mask & SN_WRITABLE) && evData->wcallback != LUA_NOREF)) {
+        return luaL_error(L, "File descriptor already has a listener.");
+    }
+    if (lua_pushthread(L)) {
+        return luaL_error(L, "loop:wait has to be called from a coroutine.");
+    }
+    
+    if ((evData->mask & mask) != mask && hloop->api->addEvent(hloop, fd, mask) == -1) {
+        return luaL_error(L, "Could not add event listener.");
+    }
+    
+    int coref = luaL_ref(L, LUA_ENVIRONINDEX);
+    evData->mask |= mask;
+    if (mask & SN_READABLE) {
+        evData->rcallback = coref;
+        evData->mask |= SN_RWAIT;
+    }
+    if (mask & SN_WRITABLE) {
+        evData->wcallback = coref;
+        evData->mask |= SN_WWAIT;
+    }
+    
+    return lua_yield(L, 0);
+}
+
+/** loop:sleep(time)
+ * Suspends the running coroutine for 'time' ({ms=5}, like in settimeout).
+ **/
+static int hop_sleep(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    
+    struct timeval tv;
+    double usec_total = table_to_usec(L, 2);
+    tv.tv_sec = (long int) (usec_total / SIM);
+    tv.tv_usec = (long int) fmod(usec_total, SIM);
+    
+    if (lua_pushthread(L)) {
+        return luaL_error(L, "loop:sleep has to be called from a coroutine.");
+    }
+    
+    int fd = hloop->api->setTimeout(hloop, &tv, getSlack(L, hloop, 2));
+    if (fd != -1 && growTimers(hloop, fd) == -1) {
+        hloop->api->clearTimer(hloop, fd);
+        fd = -1;
+    }
+    if (fd == -1) return luaL_error(L, "Could not create a new timer (internal error)");
+    
+    hloop->timers[fd].L = L;
+    hloop->timers[fd].callback = luaL_ref(L, LUA_ENVIRONINDEX);
+    hloop->timers[fd].mask = SN_TIMER | SN_ONCE | SN_SLEEP;
+    
+    return lua_yield(L, 0);
+}
+
+/** Resumes the coroutine found below 'nargs' values on top of the stack,
+ * passing the values to it. Errors end the coroutine, like they end callbacks.
+ **/
+static void resumeThread(lua_State *L, int nargs) {
+    lua_State *co = lua_tothread(L, -(nargs + 1));
+    
+    if (co) {
+        lua_xmove(L, co, nargs);
+        if (lua_resume(co, nargs) > LUA_YIELD) lua_settop(co, 0);
+    } else {
+        lua_pop(L, nargs);
+    }
+    lua_pop(L, 1);
+}
+
+/** Resumes the coroutine waiting in loop:wait for 'fd' to be ready for 'dir'
+ * (SN_READABLE or SN_WRITABLE).
+ **/
+static void resumeWaiter(lua_State *L, snHopLoop *hloop, int fd, int dir, int fired) {
+    snFileEvent *evData = &hloop->events[fd];
+    int coref = dir == SN_READABLE ? evData->rcallback : evData->wcallback;
+    int owned = SN_NONE;
+    
+    /* a coroutine waiting for "rw" owns both directions */
+    if ((evData->mask & SN_RWAIT) && evData->rcallback == coref) {
+        owned |= SN_READABLE;
+        evData->rcallback = LUA_NOREF;
+        evData->mask &= ~SN_RWAIT;
+    }
+    if ((evData->mask & SN_WWAIT) && evData->wcallback == coref) {
+        owned |= SN_WRITABLE;
+        evData->wcallback = LUA_NOREF;
+        evData->mask &= ~SN_WWAIT;
+    }
+    
+    lua_rawgeti(L, LUA_ENVIRONINDEX, coref);
+    luaL_unref(L, LUA_ENVIRONINDEX, coref);
+    lua_pushnumber(L, fd);
+    pushChMask(L, fired & owned);
+    resumeThread(L, 2);
+    
+    /* drop the interest, unless the coroutine (or a listener) took it again */
+    int unused = SN_NONE;
+    evData = &hloop->events[fd];
+    if ((owned & SN_READABLE) && evData->rcallback == LUA_NOREF) unused |= SN_READABLE;
+    if ((owned & SN_WRITABLE) && evData->wcallback == LUA_NOREF) unused |= SN_WRITABLE;
+    unused &= evData->mask;
+    if (unused) clearMask(hloop, fd, unused);
+}
+
+/* Thread pool.
+ * loop:readfile, loop:writefile, loop:stat and loop:resolve run on the
+ * worker threads of the loop. Finished jobs are queued back; the first one of
+ * a batch signals an eventfd, handled in C (SN_NATIVE). Results go to
+ * fn(loop, result[, err]), or resume the calling coroutine when there's no
+ * fn. */
+
+/* snNativeHandler of the pool eventfd */
+static void handlePool(lua_State *L, snHopLoop *hloop, int fd, int mask) {
+    snJob *job = snPoolTake(hloop->pool);
+    (void) fd;
+    (void) mask;
+    
+    while (job) {
+        snJob *next = job->next;
+        int nresults;
+        
+        hloop->stats.jobs++;
+        snHistAdd(&hloop->stats.poolWait, job->started - job->queued);
+        
+        lua_rawgeti(L, LUA_ENVIRONINDEX, job->ref);
+        luaL_unref(L, LUA_ENVIRONINDEX, job->ref);
+        if (job->thread) {
+            nresults = snPushJobResult(L, job);
+            resumeThread(L, nresults);
+        } else {
+            lua_pushvalue(L, 1);
+            nresults = snPushJobResult(L, job);
+            if (lua_pcall(L, nresults + 1, 0, 0) != 0) lua_pop(L, 1);
+        }
+        snFreeJob(job);
+        job = next;
+    }
+}
+
+static snPool *openPool(snHopLoop *hloop) {
+    snPool *pool = snPoolCreate(hloop->poolthreads ? hloop->poolthreads : SN_POOL_THREADS,
+                                hloop->pooldepth ? hloop->pooldepth : SN_POOL_DEPTH);
+    if (!pool) return NULL;
+    
+    int fd = snPoolFd(pool);
+    snFileExt *ext = growEvents(hloop, fd) == -1 ? NULL : getFileExt(hloop, fd);
+    if (!ext || hloop->api->addEvent(hloop, fd, SN_READABLE) == -1) {
+        snPoolDestroy(pool);
+        return NULL;
+    }
+    ext->handler = handlePool;
+    hloop->events[fd].mask |= SN_READABLE | SN_NATIVE;
+    hloop->pool = pool;
+    
+    return pool;
+}
+
+/** Waits for the running jobs; the ones still queued are dropped.
+ **/
+static void freePool(lua_State *L, snHopLoop *hloop) {
+    if (!hloop->pool) return;
+    
+    int fd = snPoolFd(hloop->pool);
+    clearMask(hloop, fd, SN_READABLE | SN_NATIVE);
+    freeFileExt(L, hloop, fd);
+    snPoolDestroy(hloop->pool);
+    hloop->pool = NULL;
+}
+
+/** Submits 'job', with the function at 'fnidx' (or the running coroutine if
+ * it's nil) getting the result.
+ **/
+static int submitJob(lua_State *L, snHopLoop *hloop, snJob *job, int fnidx) {
+    if (!job) return luaL_error(L, "Could not allocate a job.");
+    
+    if (lua_isnoneornil(L, fnidx)) {
+        if (lua_pushthread(L)) {
+            snFreeJob(job);
+            return luaL_error(L, "Pass a callback, or call it from a coroutine.");
+        }
+        job->thread = 1;
+    } else {
+        luaL_checktype(L, fnidx, LUA_TFUNCTION);
+        lua_pushvalue(L, fnidx);
+    }
+    
+    if (!hloop->pool && !openPool(hloop)) {
+        snFreeJob(job);
+        return luaL_error(L, "Could not start the thread pool.");
+    }
+    
+    job->ref = luaL_ref(L, LUA_ENVIRONINDEX);
+    if (snPoolSubmit(hloop->pool, job) == -1) {
+        luaL_unref(L, LUA_ENVIRONINDEX, job->ref);
+        snFreeJob(job);
+        lua_pushnil(L);
+        lua_pushliteral(L, "full");
+        return 2;
+    }
+    if (job->thread) return lua_yield(L, 0);
+    
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/** loop:readfile(path[, fn])
+ * Gets the contents of the file, or nil and an error message.
+ **/
+static int hop_readFile(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    const char *path = luaL_checkstring(L, 2);
+    
+    return submitJob(L, hloop, snNewJob(SN_JOB_READFILE, path, NULL, 0), 3);
+}
+
+/** loop:writefile(path, data[, fn])
+ * Creates or truncates the file; gets true, or nil and an error message.
+ **/
+static int hop_writeFile(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    const char *path = luaL_checkstring(L, 2);
+    size_t len;
+    const char *data = luaL_checklstring(L, 3, &len);
+    
+    return submitJob(L, hloop, snNewJob(SN_JOB_WRITEFILE, path, data, len), 4);
+}
+
+/** loop:stat(path[, fn])
+ * Gets {type=, size=, mode=, uid=, gid=, atime=, mtime=, ctime=}, or nil and
+ * an error message.
+ **/
+static int hop_stat(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    const char *path = luaL_checkstring(L, 2);
+    
+    return submitJob(L, hloop, snNewJob(SN_JOB_STAT, path, NULL, 0), 3);
+}
+
+/** loop:resolve(host[, fn])
+ * Gets an array of IPv4 and IPv6 addresses, or nil and an error message.
+ **/
+static int hop_resolve(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    const char *host = luaL_checkstring(L, 2);
+    
+    return submitJob(L, hloop, snNewJob(SN_JOB_RESOLVE, host, NULL, 0), 3);
+}
+
+/** loop:pool{threads=4, depth=1024}
+ * Sets the number of threads and of queued jobs, before the first job.
+ **/
+static int hop_pool(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    
+    if (hloop->pool) return luaL_error(L, "The thread pool is running already.");
+    
+    lua_getfield(L, 2, "threads");
+    int threads = luaL_optnumber(L, -1, SN_POOL_THREADS);
+    lua_getfield(L, 2, "depth");
+    int depth = luaL_optnumber(L, -1, SN_POOL_DEPTH);
+    if (threads < 1 || depth < 1) return luaL_error(L, "Invalid pool settings.");
+    
+    hloop->poolthreads = threads;
+    hloop->pooldepth = depth;
+    
+    return 0;
+}
+
+/** Runs a specified callback.
+ * IMPORTANT: this function expects, that 
+ * luaL_checkudata(L, 1, "pl.makenika.hoploop") will return a valid luahop object.
+ **/
+static int run_callback(lua_State *L, lua_State *ctx, int clbref, int fd, int mask, snHopLoop *hloop) {
+    lua_rawgeti(L, LUA_ENVIRONINDEX, clbref);
+    if (!lua_isfunction(L, -1)) return luaL_error(L, "Function was expected");
+    
+    //call user function: callback(loop, fd, type)
+    lua_pushvalue(L, 1);
+    lua_pushnumber(L, fd);
+    pushChMask(L, mask);
+    if (ctx != L) lua_xmove(L, ctx, 4);
+    
+    if (lua_pcall(ctx, 3, 0, 0) != 0) lua_pop(ctx, 1);
+    
+    return 0;
+}
+
+static void dispatchTimer(lua_State *L, snHopLoop *hloop, int fd, int mask) {
+    snTimerEvent *timerEvent = &hloop->timers[fd];
+    lua_State *ctx = timerEvent->L;
+    
+    if ((timerEvent->mask & SN_SLEEP) && (mask & SN_TIMER)) {
+        lua_rawgeti(L, LUA_ENVIRONINDEX, timerEvent->callback);
+        _clearTimer(L, hloop, fd);
+        resumeThread(L, 0);
+    } else if (timerEvent->mask & mask & SN_TIMER) {
+        int callback = timerEvent->callback;
+        run_callback(L, ctx, callback, fd, mask, hloop);
+        
+        /* the callback may grow the timer table */
+        if (hloop->timers[fd].mask & SN_ONCE) {
+            _clearTimer(L, hloop, fd);
+        }
+    }
+}
+
+static void dispatchFileEvent(lua_State *L, snHopLoop *hloop, int fd, int mask) {
+    /* callbacks may grow the tables and change the listeners of the fd
+     (the write queue callbacks too), so hloop->events[fd] is looked up
+     again after each of them */
+    int rcallback = LUA_NOREF;
+    
+    if (hloop->events[fd].mask & SN_NATIVE) {
+        hloop->exts[fd]->handler(L, hloop, fd, mask);
+        return;
+    }
+    if ((mask & SN_WRITABLE) && (hloop->events[fd].mask & SN_WQUEUE)) {
+        flushQueue(L, hloop, fd);
+    }
+    if (hloop->events[fd].mask & mask & SN_READABLE) {
+        rcallback = hloop->events[fd].rcallback;
+        if (hloop->events[fd].mask & SN_RWAIT) {
+            resumeWaiter(L, hloop, fd, SN_READABLE, mask);
+        } else if (rcallback != LUA_NOREF) {
+            run_callback(L, hloop->events[fd].L, rcallback, fd, mask, NULL);
+        }
+    }
+    if (hloop->events[fd].mask & mask & SN_WRITABLE) {
+        int wcallback = hloop->events[fd].wcallback;
+        if (hloop->events[fd].mask & SN_WWAIT) {
+            resumeWaiter(L, hloop, fd, SN_WRITABLE, mask);
+        } else if (wcallback != LUA_NOREF && wcallback != rcallback) {
+            run_callback(L, hloop->events[fd].L, wcallback, fd, mask, NULL);
+        }
+    }
+}
+
+/* The clock is read only when dispatch switches between file events (kind 0)
+ and timers (kind 1), so the histograms get the time spent on each kind per
+ poll rather than per callback. */
+typedef struct snDispatchClock {
+    unsigned long long spent[2];
+    int counted[2];
+    int kind;
+    unsigned long long now;
+} snDispatchClock;
+
+static void switchKind(snDispatchClock *clock, int kind) {
+    if (kind != clock->kind) {
+        if (clock->kind != -1) {
+            unsigned long long start = clock->now;
+            clock->now = snNanoTime();
+            clock->spent[clock->kind] += clock->now - start;
+        }
+        clock->kind = kind;
+    }
+    clock->counted[kind]++;
+}
+
+/* Budget and priorities.
+ * Fired file events are kept in hloop->carry, oldest first, each fd once.
+ * An iteration dispatches the +high fds, the expired timers, the other fds
+ * and the +low fds, until the budget of loop:budget runs out; the rest is
+ * carried over, and the next poll doesn't block. Timers always run, since
+ * the wheel has rescheduled them already. */
+
+#define getPriority(mask) ((mask) & SN_HIGH ? SN_HIGH : (mask) & SN_LOW)
+
+/** Dispatches the carried events of one priority class ('prio' is SN_HIGH,
+ * SN_LOW or 0), while '*left' callbacks remain and 'deadline' (0 for none)
+ * hasn't passed. Returns 0 when the budget runs out.
+ **/
+static int dispatchCarried(lua_State *L, snHopLoop *hloop, snDispatchClock *clock,
+                           int prio, int *left, unsigned long long deadline) {
+    int i;
+    
+    for (i = 0; i < hloop->ncarry; i++) {
+        int fd = hloop->carry[i].fd;
+        if (fd == -1) continue;
+        
+        /* the event is stale, if its fd was removed meanwhile */
+        if (hloop->events[fd].carried != i + 1) {
+            hloop->carry[i].fd = -1;
+            continue;
+        }
+        if (getPriority(hloop->events[fd].mask) != prio) continue;
+        if (*left == 0 || (deadline && clock->now >= deadline)) return 0;
+        
+        hloop->carry[i].fd = -1;
+        hloop->events[fd].carried = 0;
+        switchKind(clock, 0);
+        dispatchFileEvent(L, hloop, fd, hloop->carry[i].mask);
+        if (*left > 0) (*left)--;
+        if (deadline) {
+            unsigned long long now = snNanoTime();
+            clock->spent[0] += now - clock->now;
+            clock->now = now;
+        }
+    }
+    
+    return 1;
+}
+
+static void dispatchScheduled(lua_State *L, snHopLoop *hloop, int nevents,
+                              snDispatchClock *clock) {
+    int i, ntimers = 0;
+    
+    if (hloop->carrysize < hloop->setsize) {
+        snFiredEvent *carry = realloc(hloop->carry, sizeof(snFiredEvent) * hloop->setsize);
+        if (carry) {
+            hloop->carry = carry;
+            hloop->carrysize = hloop->setsize;
+        }
+    }
+    
+    /* new file events join the carried ones; timers stay in fired */
+    for (i = 0; i < nevents; i++) {
+        snFiredEvent fevent = hloop->fired[i];
+        int carried = fevent.mask & SN_TIMER ? 0 : hloop->events[fevent.fd].carried;
+        
+        if (fevent.mask & SN_TIMER) {
+            hloop->fired[ntimers++] = fevent;
+        } else if (carried) {
+            hloop->carry[carried - 1].mask |= fevent.mask;
+        } else if (hloop->ncarry < hloop->carrysize) {
+            hloop->carry[hloop->ncarry] = fevent;
+            hloop->events[fevent.fd].carried = ++hloop->ncarry;
+        } else {
+            /* out of memory; dispatch it right away */
+            switchKind(clock, 0);
+            dispatchFileEvent(L, hloop, fevent.fd, fevent.mask);
+        }
+    }
+    
+    int left = hloop->budgetCallbacks ? hloop->budgetCallbacks : -1;
+    unsigned long long deadline = hloop->budgetUsec ?
+            clock->now + hloop->budgetUsec * 1000ULL : 0;
+    
+    if (dispatchCarried(L, hloop, clock, SN_HIGH, &left, deadline)) {
+        for (i = 0; i < ntimers; i++) {
+            switchKind(clock, 1);
+            dispatchTimer(L, hloop, hloop->fired[i].fd, hloop->fired[i].mask);
+        }
+        if (dispatchCarried(L, hloop, clock, 0, &left, deadline)) {
+            dispatchCarried(L, hloop, clock, SN_LOW, &left, deadline);
+        }
+    } else {
+        for (i = 0; i < ntimers; i++) {
+            switchKind(clock, 1);
+            dispatchTimer(L, hloop, hloop->fired[i].fd, hloop->fired[i].mask);
+        }
+    }
+    
+    /* keep what's left, in order */
+    int ncarry = 0;
+    for (i = 0; i < hloop->ncarry; i++) {
+        int fd = hloop->carry[i].fd;
+        if (fd == -1 || hloop->events[fd].carried != i + 1) continue;
+        hloop->carry[ncarry] = hloop->carry[i];
+        hloop->events[fd].carried = ++ncarry;
+    }
+    hloop->ncarry = ncarry;
+}
+
+/** loop:budget{callbacks=n, us=n}
+ * Limits the number of file events handled by one iteration, or the time
+ * spent on them; either limit may be left out (or 0). Ready fds over the budget are carried over to the next
+ * iteration, before the ones fired later. loop:budget{} removes the limits.
+ **/
+static int hop_budget(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    
+    lua_getfield(L, 2, "callbacks");
+    int callbacks = luaL_optnumber(L, -1, 0);
+    lua_getfield(L, 2, "us");
+    int usec = luaL_optnumber(L, -1, 0);
+    if (callbacks < 0 || usec < 0) return luaL_error(L, "Invalid budget.");
+    
+    hloop->budgetCallbacks = callbacks;
+    hloop->budgetUsec = usec;
+    
+    return 0;
+}
+
+/** loop:poll([timeout])
+ * Waits for events up to 'timeout' (a time table; {} or {ms=0} doesn't
+ * block, no table waits until there are events) and handles them.
+ **/
+static int hop_dispatch(lua_State *L);
+
+/** Polls the backend and counts the poll in the stats. Returns the number
+ * of fired events.
+ **/
+static int pollEvents(snHopLoop *hloop, struct timespec *tsp) {
+    snLoopStats *stats = &hloop->stats;
+    unsigned long long start = snNanoTime();
+    int nevents = hloop->api->poll(hloop, tsp);
+    unsigned long long now = snNanoTime();
+    hloop->now = now;
+    
+    if (hloop->worker) snCountPoll(hloop->worker, nevents);
+    stats->polls++;
+    snHistAdd(&stats->wait, now - start);
+    snHistAdd(&stats->perPoll, nevents > 0 ? nevents : 0);
+    
+    return nevents;
+}
+
+/* Native handlers.
+ * C modules handle fds through the luahop_Api of luahop.h: their fds are
+ * SN_NATIVE, with handleExternal as the handler, and their events are
+ * dispatched before any Lua callback of the poll. */
+
+/* snNativeHandler of fds of other C modules */
+static void handleExternal(lua_State *L, snHopLoop *hloop, int fd, int mask) {
+    snFileExt *ext = hloop->exts[fd];
+    (void) L;
+    mask &= hloop->events[fd].mask & (SN_READABLE | SN_WRITABLE);
+    if (mask != SN_NONE) ext->nativefn(hloop, fd, mask, ext->nativedata);
+}
+
+static int isExternal(snHopLoop *hloop, int fd) {
+    return (hloop->events[fd].mask & SN_NATIVE) && hloop->exts[fd]->handler == handleExternal;
+}
+
+static int addNative(snHopLoop *hloop, int fd, int mask, luahop_NativeFn fn, void *udata) {
+    mask &= SN_READABLE | SN_WRITABLE;
+    if (!fn || mask == SN_NONE || growEvents(hloop, fd) == -1) return -1;
+    
+    int current = hloop->events[fd].mask;
+    if ((current & SN_POLLED) && !isExternal(hloop, fd)) return -1;
+    
+    snFileExt *ext = getFileExt(hloop, fd);
+    if (!ext || hloop->api->addEvent(hloop, fd, mask) == -1) return -1;
+    hloop->events[fd].mask |= mask | SN_NATIVE;
+    if (current & ~mask & SN_POLLED) clearMask(hloop, fd, current & ~mask & SN_POLLED);
+    ext->handler = handleExternal;
+    ext->nativefn = fn;
+    ext->nativedata = udata;
+    hloop->natives = 1;
+    
+    return 0;
+}
+
+static void removeNative(snHopLoop *hloop, int fd) {
+    if (fd < 0 || fd >= hloop->setsize || !isExternal(hloop, fd)) return;
+    
+    clearMask(hloop, fd, SN_READABLE | SN_WRITABLE | SN_NATIVE);
+    hloop->exts[fd]->nativefn = NULL;
+    hloop->exts[fd]->nativedata = NULL;
+}
+
+static snHopLoop *getLoop(lua_State *L, int idx) {
+    void *hloop = lua_touserdata(L, idx);
+    if (!hloop || !lua_getmetatable(L, idx)) return NULL;
+    
+    luaL_getmetatable(L, "pl.makenika.hoploop");
+    int same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    
+    return same ? hloop : NULL;
+}
+
+/** Runs the handlers of native fds among the first 'nevents' fired events
+ * and drops their events from fired. Returns the number of events left.
+ **/
+static int dispatchNatives(snHopLoop *hloop, int nevents) {
+    int i, left = 0;
+    
+    for (i = 0; i < nevents; i++) {
+        /* handlers may grow the tables */
+        snFiredEvent fevent = hloop->fired[i];
+        
+        if (!(fevent.mask & SN_TIMER) && isExternal(hloop, fevent.fd)) {
+            handleExternal(NULL, hloop, fevent.fd, fevent.mask);
+            hloop->stats.events++;
+        } else {
+            hloop->fired[left++] = fevent;
+        }
+    }
+    
+    return left;
+}
+
+static const luahop_Api api = {
+    LUAHOP_API_VERSION,
+    snInboxOpen,
+    snInboxPost,
+    snInboxRelease,
+    getLoop,
+    addNative,
+    removeNative
+};
+
+/** Runs the callbacks of the first 'nevents' fired events (and of carried
+ * over ones), then the check hooks and the deferred functions.
+ **/
+static void dispatchEvents(lua_State *L, snHopLoop *hloop, int nevents) {
+    snLoopStats *stats = &hloop->stats;
+    snDispatchClock clock = {{0, 0}, {0, 0}, -1, hloop->now};
+    int i;
+    
+    if (hloop->natives) nevents = dispatchNatives(hloop, nevents);
+    if (hloop->prioritized || hloop->budgetCallbacks || hloop->budgetUsec ||
+        hloop->ncarry > 0) {
+        dispatchScheduled(L, hloop, nevents, &clock);
+    } else {
+        for (i = 0; i < nevents; i++) {
+            snFiredEvent fevent = hloop->fired[i];
+            
+            if (fevent.mask & SN_TIMER) {
+                switchKind(&clock, 1);
+                dispatchTimer(L, hloop, fevent.fd, fevent.mask);
+            } else {
+                switchKind(&clock, 0);
+                dispatchFileEvent(L, hloop, fevent.fd, fevent.mask);
+            }
+        }
+    }
+    
+    if (clock.kind != -1) clock.spent[clock.kind] += snNanoTime() - clock.now;
+    if (clock.counted[0]) {
+        stats->events += clock.counted[0];
+        snHistAdd(&stats->fdCallback, clock.spent[0]);
+    }
+    if (clock.counted[1]) {
+        stats->timers += clock.counted[1];
+        stats->timerBatches++;
+        snHistAdd(&stats->timerCallback, clock.spent[1]);
+    }
+    stats->carried += hloop->ncarry;
+    
+    if (hloop->ndeadlines > 0) expireDeadlines(L, hloop);
+    if (hloop->check.count > 0) runHooks(L, &hloop->check);
+    if (hloop->deferred.count > 0) runDeferred(L, hloop);
+}
+
+static int hop_poll(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    struct timespec ts, *tsp = NULL;
+    
+    /* luahop_ffi_poll left events in fired; the next poll would lose them */
+    if (hloop->ffipending > 0) return hop_dispatch(L);
+    
+    if (lua_istable(L, 2)) {
+        double usec_total = table_to_usec(L, 2);
+        if (usec_total < 0) usec_total = 0;
+        
+        ts.tv_sec = (time_t) (usec_total / SIM);
+        ts.tv_nsec = (long) (fmod(usec_total, SIM) * 1000);
+        tsp = &ts;
+    }
+    
+    if (hloop->idle.count > hloop->idle.removed) runHooks(L, &hloop->idle);
+    if (hloop->prepare.count > 0) runHooks(L, &hloop->prepare);
+    if (hloop->deferred.count > 0 || hloop->idle.count > hloop->idle.removed ||
+        hloop->ncarry > 0) {
+        ts.tv_sec = 0;
+        ts.tv_nsec = 0;
+        tsp = &ts; /* don't block */
+    }
+    limitWait(hloop, &ts, &tsp);
+    
+    int nevents = pollEvents(hloop, tsp);
+    dispatchEvents(L, hloop, nevents);
+    
+    return 0;
+}
+
+/* LuaJIT FFI.
+ * The functions of luahop_ffi.h poll without the Lua C API, so a JIT
+ * compiled loop can dispatch the events of its own listeners (SN_FFI) in
+ * Lua. The other events are moved to the start of fired, for
+ * loop:dispatch(). */
+
+int luahop_ffi_version(void) {
+    return LUAHOP_FFI_VERSION;
+}
+
+int luahop_ffi_listen(void *loop, int fd, int mask) {
+    snHopLoop *hloop = loop;
+    mask &= SN_READABLE | SN_WRITABLE;
+    
+    if (growEvents(hloop, fd) == -1) return -1;
+    int current = hloop->events[fd].mask;
+    if ((current & SN_POLLED) && !(current & SN_FFI)) return -1;
+    if (hloop->api->addEvent(hloop, fd, mask) == -1) return -1;
+    hloop->events[fd].mask |= mask | SN_FFI;
+    
+    return 0;
+}
+
+void luahop_ffi_unlisten(void *loop, int fd, int mask) {
+    snHopLoop *hloop = loop;
+    
+    if (fd < 0 || fd >= hloop->setsize) return;
+    if (!(hloop->events[fd].mask & SN_FFI)) return;
+    mask &= hloop->events[fd].mask & (SN_READABLE | SN_WRITABLE);
+    if (mask != SN_NONE) clearMask(hloop, fd, mask);
+}
+
+int luahop_ffi_poll(void *loop, long long timeout_ns, luahop_event *out, int max) {
+    snHopLoop *hloop = loop;
+    struct timespec ts, *tsp = NULL;
+    int i, nout = 0, nrest = 0;
+    
+    if (hloop->ffipending > 0) return 0;
+    if (hloop->deferred.count > 0 || hloop->idle.count > hloop->idle.removed ||
+        hloop->ncarry > 0) {
+        timeout_ns = 0; /* don't block */
+    }
+    if (timeout_ns >= 0) {
+        ts.tv_sec = timeout_ns / 1000000000LL;
+        ts.tv_nsec = timeout_ns % 1000000000LL;
+        tsp = &ts;
+    }
+    limitWait(hloop, &ts, &tsp);
+    
+    int nevents = pollEvents(hloop, tsp);
+    if (nevents < 0) return -1;
+    
+    for (i = 0; i < nevents; i++) {
+        snFiredEvent fevent = hloop->fired[i];
+        int fdmask = (fevent.mask & SN_TIMER) ? 0 : hloop->events[fevent.fd].mask;
+        
+        if (!(fdmask & SN_FFI)) {
+            hloop->fired[nrest++] = fevent;
+        } else if (nout < max && (fevent.mask & fdmask & SN_POLLED)) {
+            out[nout].fd = fevent.fd;
+            out[nout].mask = fevent.mask & fdmask & (SN_READABLE | SN_WRITABLE);
+            nout++;
+        }
+    }
+    hloop->ffipending = nrest;
+    hloop->stats.events += nout;
+    
+    return nout;
+}
+
+int luahop_ffi_pending(void *loop) {
+    snHopLoop *hloop = loop;
+    
+    return hloop->ffipending > 0 || hloop->ncarry > 0 || hloop->check.count > 0 ||
+           hloop->deferred.count > 0 ||
+           (hloop->ndeadlines > 0 && hloop->dltick < hloop->now / SN_DEADLINE_TICK);
+}
+
+int luahop_ffi_stopped(void *loop) {
+    snHopLoop *hloop = loop;
+    int stopped = hloop->shouldStop;
+    
+    hloop->shouldStop = 0;
+    
+    return stopped;
+}
+
+/** loop:dispatch()
+ * Runs what a luahop_ffi_poll left for the Lua C API: the callbacks of the
+ * events of other listeners and of timers, the check hooks and the deferred
+ * functions.
+ **/
+static int hop_dispatch(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int nevents = hloop->ffipending;
+    
+    hloop->ffipending = 0;
+    dispatchEvents(L, hloop, nevents);
+    
+    return 0;
+}
+
+/** loop:now()
+ * Returns a monotonic time in milliseconds (with a fraction), read once per
+ * loop iteration, right after the poll.
+ **/
+static int hop_now(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    lua_pushnumber(L, (lua_Number) hloop->now / 1e6);
+    
+    return 1;
+}
+
+/** loop:stats()
+ * Returns counters and histograms (see stats.c) collected since the loop was
+ * created or since loop:resetstats(), and the number of fds and timers
+ * registered now.
+ **/
+static int hop_stats(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    int i, fds = 0, timers = 0;
+    
+    for (i = 0; i < hloop->setsize; i++) {
+        if (hloop->events[i].mask & SN_POLLED) fds++;
+    }
+    for (i = 0; i < hloop->timersize; i++) {
+        if (hloop->timers[i].mask != SN_NONE) timers++;
+    }
+    
+    snPushStats(L, &hloop->stats);
+    lua_pushnumber(L, fds);
+    lua_setfield(L, -2, "fds");
+    lua_pushnumber(L, timers);
+    lua_setfield(L, -2, "timers");
+    
+    return 1;
+}
+
+static int hop_resetStats(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    memset(&hloop->stats, 0, sizeof(snLoopStats));
+    
+    return 0;
+}
+
+static int hop_stop(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    hloop->shouldStop = 1;
+    
+    return 0;
+}
+
+static int hop_loop(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    hloop->shouldStop = 0;
+    
+    while (hloop->shouldStop == 0) {
+        hop_poll(L);
+    }
+    
+    return 0;
+}
+
+static int hop_repr(lua_State *L) {
+    snHopLoop *hloop = checkLoop(L);
+    lua_pushfstring(L, "<Hop Loop: %s>", hloop->api->name);
+    
+    return 1;
 }
 
 static int hop_gc(lua_State *L) {
     snHopLoop *hloop = checkLoop(L);
-    closeLoop(hloop);
     
-    /* free only those members; hloop itself is freed by Lua */
-    free(hloop->api);
-    free(hloop->state);
+    /* free only the members; hloop itself is freed by Lua */
+    freeLoop(L, hloop);
     
     return 0;
 }
@@ -404,11 +2913,43 @@ static int hop_gc(lua_State *L) {
 static const struct luaL_Reg hoplib_m [] = {
     {"setlistener", hop_addEvent},
     {"rmlistener", hop_removeEvent},
+    {"rearm", hop_rearmEvent},
+    {"acceptor", hop_acceptor},
+    {"datagram", hop_datagram},
+    {"sendbatch", hop_sendBatch},
+    {"write", hop_write},
+    {"sendfile", hop_sendfile},
+    {"buffer", hop_buffer},
+    {"readinto", hop_readInto},
+    {"writeopts", hop_writeOpts},
+    {"discard", hop_discard},
+    {"wait", hop_wait},
+    {"sleep", hop_sleep},
     {"settimeout", hop_setTimeout},
     {"setinterval", hop_setInterval},
     {"rmtimeout", hop_clearTimer},
     {"rminterval", hop_clearTimer},
+    {"setdeadline", hop_setDeadline},
+    {"touch", hop_touch},
+    {"slack", hop_slack},
     {"poll", hop_poll},
+    {"dispatch", hop_dispatch},
+    {"onsignal", hop_onSignal},
+    {"inbox", hop_inbox},
+    {"pool", hop_pool},
+    {"readfile", hop_readFile},
+    {"writefile", hop_writeFile},
+    {"stat", hop_stat},
+    {"resolve", hop_resolve},
+    {"defer", hop_defer},
+    {"idle", hop_idle},
+    {"prepare", hop_prepare},
+    {"check", hop_check},
+    {"rmhook", hop_removeHook},
+    {"now", hop_now},
+    {"budget", hop_budget},
+    {"stats", hop_stats},
+    {"resetstats", hop_resetStats},
     {"stop", hop_stop},
     {"loop", hop_loop},
     {"__tostring", hop_repr},
@@ -422,7 +2963,13 @@ static const struct luaL_Reg hoplib [] = {
 };
 
 LUALIB_API int luaopen_luahop(lua_State *L) {
+    int mask;
+    
     lua_newtable(L);
+    for (mask = SN_READABLE; mask <= SN_TIMER; mask++) {
+        lua_pushstring(L, getChMask(mask));
+        lua_rawseti(L, -2, getModeKey(mask));
+    }
     lua_replace(L, LUA_ENVIRONINDEX);
     
     luaL_newmetatable(L, "pl.makenika.hoploop");
@@ -431,6 +2978,12 @@ LUALIB_API int luaopen_luahop(lua_State *L) {
     luaL_register(L, NULL, hoplib_m);
     
     luaL_register(L, "luahop", hoplib);
+    snOpenCluster(L);
+    snOpenInbox(L);
+    snOpenBuffer(L);
+    
+    lua_pushlightuserdata(L, (void *) &api);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUAHOP_API_KEY);
     
     return 1;
 }
\ No newline at end of file
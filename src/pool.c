@@ -0,0 +1,377 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <lua.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "pool.h"
+#include "stats.h"
+
+struct snPool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Signaled when a job is queued, or on shutdown */
+    pthread_t *threads;
+    int nthreads;
+    snJob *head; /* Jobs waiting for a thread */
+    snJob *tail;
+    int queued;
+    int depth;
+    snJob *done; /* Finished jobs, waiting for the loop */
+    snJob *donetail;
+    int rfd; /* eventfd (or the read end of a pipe) */
+    int wfd;
+    int stopping;
+};
+
+static void readFile(snJob *job) {
+    int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        job->err = errno;
+        return;
+    }
+    
+    struct stat st;
+    size_t size = (fstat(fd, &st) == 0 && st.st_size > 0) ? st.st_size : 4096;
+    ssize_t n;
+    
+    job->data = malloc(size);
+    job->len = 0;
+    while (job->data) {
+        if (job->len == size) {
+            char *data = realloc(job->data, size * 2);
+            if (!data) break;
+            job->data = data;
+            size *= 2;
+        }
+        n = read(fd, job->data + job->len, size - job->len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == -1) job->err = errno;
+            break;
+        }
+        job->len += n;
+    }
+    if (!job->data) job->err = ENOMEM;
+    close(fd);
+}
+
+static void writeFile(snJob *job) {
+    int fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        job->err = errno;
+        return;
+    }
+    
+    size_t written = 0;
+    ssize_t n;
+    while (written < job->len) {
+        n = write(fd, job->data + written, job->len - written);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            job->err = errno;
+            break;
+        }
+        written += n;
+    }
+    if (close(fd) == -1 && !job->err) job->err = errno;
+}
+
+static void resolve(snJob *job) {
+    struct addrinfo hints;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM; /* one entry per address */
+    job->err = getaddrinfo(job->path, NULL, &hints, &job->addrs);
+}
+
+static void runJob(snJob *job) {
+    switch (job->type) {
+        case SN_JOB_READFILE: readFile(job); break;
+        case SN_JOB_WRITEFILE: writeFile(job); break;
+        case SN_JOB_STAT: if (stat(job->path, &job->st) == -1) job->err = errno; break;
+        case SN_JOB_RESOLVE: resolve(job); break;
+    }
+}
+
+static void *runWorker(void *arg) {
+    snPool *pool = arg;
+    snJob *job;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->stopping) pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->stopping) break;
+        
+        job = pool->head;
+        pool->head = job->next;
+        if (!pool->head) pool->tail = NULL;
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+        
+        job->started = snNanoTime();
+        runJob(job);
+        job->next = NULL;
+        
+        pthread_mutex_lock(&pool->lock);
+        if (pool->done) {
+            pool->donetail->next = job;
+        } else {
+            /* the first job of a batch wakes the loop up */
+            pool->done = job;
+#ifdef __linux__
+            uint64_t one = 1;
+            if (write(pool->wfd, &one, sizeof(one))) {}
+#else
+            if (write(pool->wfd, "", 1)) {}
+#endif
+        }
+        pool->donetail = job;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    return NULL;
+}
+
+static int openWakeup(snPool *pool) {
+#ifdef __linux__
+    pool->rfd = pool->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return pool->rfd;
+#else
+    int fds[2];
+    if (pipe(fds) == -1) return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    pool->rfd = fds[0];
+    pool->wfd = fds[1];
+    return 0;
+#endif
+}
+
+/** Starts 'nthreads' threads, which take up to 'depth' queued jobs.
+ * Returns NULL on errors.
+ **/
+snPool *snPoolCreate(int nthreads, int depth) {
+    snPool *pool = calloc(1, sizeof(snPool));
+    if (!pool) return NULL;
+    
+    pool->threads = malloc(sizeof(pthread_t) * nthreads);
+    if (!pool->threads || openWakeup(pool) == -1) {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->depth = depth;
+    
+    while (pool->nthreads < nthreads) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, runWorker, pool) != 0) {
+            snPoolDestroy(pool);
+            return NULL;
+        }
+        pool->nthreads++;
+    }
+    
+    return pool;
+}
+
+/** Waits for the running jobs to finish and frees the pool with all its jobs.
+ * References to Lua callbacks are left to the caller.
+ **/
+void snPoolDestroy(snPool *pool) {
+    int i;
+    snJob *job;
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++) pthread_join(pool->threads[i], NULL);
+    
+    while ((job = pool->head)) {
+        pool->head = job->next;
+        snFreeJob(job);
+    }
+    while ((job = pool->done)) {
+        pool->done = job->next;
+        snFreeJob(job);
+    }
+    close(pool->rfd);
+    if (pool->wfd != pool->rfd) close(pool->wfd);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->threads);
+    free(pool);
+}
+
+int snPoolFd(snPool *pool) {
+    return pool->rfd;
+}
+
+/** Allocates a job; 'data' (written by SN_JOB_WRITEFILE) is copied.
+ **/
+snJob *snNewJob(int type, const char *path, const char *data, size_t len) {
+    snJob *job = calloc(1, sizeof(snJob));
+    if (!job) return NULL;
+    
+    job->type = type;
+    job->path = strdup(path);
+    if (data) {
+        job->data = malloc(len ? len : 1);
+        if (job->data) memcpy(job->data, data, len);
+        job->len = len;
+    }
+    if (!job->path || (data && !job->data)) {
+        snFreeJob(job);
+        return NULL;
+    }
+    
+    return job;
+}
+
+void snFreeJob(snJob *job) {
+    if (job->addrs) freeaddrinfo(job->addrs);
+    free(job->path);
+    free(job->data);
+    free(job);
+}
+
+/** Queues a job. Returns 0, or -1 if the queue is full.
+ **/
+int snPoolSubmit(snPool *pool, snJob *job) {
+    job->next = NULL;
+    job->queued = snNanoTime();
+    
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queued >= pool->depth) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    if (pool->tail) pool->tail->next = job;
+    else pool->head = job;
+    pool->tail = job;
+    pool->queued++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    
+    return 0;
+}
+
+/** Returns the list of finished jobs, in order, and clears the wakeup.
+ **/
+snJob *snPoolTake(snPool *pool) {
+    char buf[64];
+    
+    pthread_mutex_lock(&pool->lock);
+    while (read(pool->rfd, buf, sizeof(buf)) > 0) {}
+    snJob *jobs = pool->done;
+    pool->done = pool->donetail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    
+    return jobs;
+}
+
+static const char *fileType(mode_t mode) {
+    if (S_ISREG(mode)) return "file";
+    if (S_ISDIR(mode)) return "directory";
+    if (S_ISLNK(mode)) return "link";
+    if (S_ISFIFO(mode)) return "fifo";
+    if (S_ISSOCK(mode)) return "socket";
+    if (S_ISCHR(mode) || S_ISBLK(mode)) return "device";
+    return "other";
+}
+
+static void setNumber(lua_State *L, const char *key, lua_Number value) {
+    lua_pushnumber(L, value);
+    lua_setfield(L, -2, key);
+}
+
+static void pushStat(lua_State *L, struct stat *st) {
+    lua_createtable(L, 0, 8);
+    lua_pushstring(L, fileType(st->st_mode));
+    lua_setfield(L, -2, "type");
+    setNumber(L, "size", st->st_size);
+    setNumber(L, "mode", st->st_mode & 07777);
+    setNumber(L, "uid", st->st_uid);
+    setNumber(L, "gid", st->st_gid);
+    setNumber(L, "atime", st->st_atime);
+    setNumber(L, "mtime", st->st_mtime);
+    setNumber(L, "ctime", st->st_ctime);
+}
+
+static void pushAddresses(lua_State *L, struct addrinfo *addrs) {
+    char ip[INET6_ADDRSTRLEN];
+    struct addrinfo *ai;
+    int n = 0;
+    
+    lua_newtable(L);
+    for (ai = addrs; ai; ai = ai->ai_next) {
+        const void *addr;
+        if (ai->ai_family == AF_INET) {
+            addr = &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+        } else if (ai->ai_family == AF_INET6) {
+            addr = &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+        } else {
+            continue;
+        }
+        if (inet_ntop(ai->ai_family, addr, ip, sizeof(ip))) {
+            lua_pushstring(L, ip);
+            lua_rawseti(L, -2, ++n);
+        }
+    }
+}
+
+/** Pushes the result of a finished job: a value, or nil and an error
+ * message. Returns the number of pushed values.
+ **/
+int snPushJobResult(lua_State *L, snJob *job) {
+    if (job->err) {
+        lua_pushnil(L);
+        if (job->type == SN_JOB_RESOLVE) lua_pushstring(L, gai_strerror(job->err));
+        else lua_pushstring(L, strerror(job->err));
+        return 2;
+    }
+    
+    switch (job->type) {
+        case SN_JOB_READFILE: lua_pushlstring(L, job->data, job->len); break;
+        case SN_JOB_WRITEFILE: lua_pushboolean(L, 1); break;
+        case SN_JOB_STAT: pushStat(L, &job->st); break;
+        case SN_JOB_RESOLVE: pushAddresses(L, job->addrs); break;
+        default: lua_pushnil(L);
+    }
+    
+    return 1;
+}
@@ -0,0 +1,67 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Worker threads of a loop, for blocking jobs (file I/O, stat, DNS).
+ * Threads only run C code; results are queued back and pushed to Lua by the
+ * loop, which is woken up once per batch through an eventfd. */
+
+#ifndef __SN_POOL__
+#define __SN_POOL__
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <lua.h>
+
+#define SN_POOL_THREADS 4 /* Default number of threads */
+#define SN_POOL_DEPTH 1024 /* Default number of jobs waiting for a thread */
+
+#define SN_JOB_READFILE 1
+#define SN_JOB_WRITEFILE 2
+#define SN_JOB_STAT 3
+#define SN_JOB_RESOLVE 4
+
+typedef struct snJob {
+    struct snJob *next;
+    int type;
+    int ref; /* Callback or coroutine, in the loop's environment */
+    int thread; /* ref is a coroutine */
+    char *path; /* Path, or host name */
+    char *data; /* Written or read data */
+    size_t len;
+    int err; /* errno, or an EAI_* code for SN_JOB_RESOLVE; 0 on success */
+    struct stat st;
+    struct addrinfo *addrs;
+    unsigned long long queued; /* snNanoTime when submitted */
+    unsigned long long started; /* snNanoTime when a thread took it */
+} snJob;
+
+typedef struct snPool snPool;
+
+snPool *snPoolCreate(int nthreads, int depth);
+void snPoolDestroy(snPool *pool);
+int snPoolFd(snPool *pool);
+snJob *snNewJob(int type, const char *path, const char *data, size_t len);
+void snFreeJob(snJob *job);
+int snPoolSubmit(snPool *pool, snJob *job);
+snJob *snPoolTake(snPool *pool);
+int snPushJobResult(lua_State *L, snJob *job);
+
+#endif
@@ -0,0 +1,84 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <lua.h>
+#include <time.h>
+#include "stats.h"
+
+/** Returns a monotonic time in nanoseconds.
+ **/
+unsigned long long snNanoTime(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void setNumber(lua_State *L, const char *key, unsigned long long value) {
+    lua_pushnumber(L, (lua_Number) value);
+    lua_setfield(L, -2, key);
+}
+
+/** Pushes {count=, sum=, max=, buckets={...}}, where buckets[i] is the number
+ * of values in [2^(i-2), 2^(i-1)) (buckets[1] counts zeros). Trailing empty
+ * buckets are left out.
+ **/
+static void pushHistogram(lua_State *L, snHistogram *hist) {
+    int i, last = SN_HIST_BUCKETS - 1;
+    
+    lua_createtable(L, 0, 4);
+    setNumber(L, "count", hist->count);
+    setNumber(L, "sum", hist->sum);
+    setNumber(L, "max", hist->max);
+    
+    while (last >= 0 && hist->buckets[last] == 0) last--;
+    lua_createtable(L, last + 1, 0);
+    for (i = 0; i <= last; i++) {
+        lua_pushnumber(L, (lua_Number) hist->buckets[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "buckets");
+}
+
+/** Pushes a table with the counters and histograms of 'stats'.
+ **/
+void snPushStats(lua_State *L, snLoopStats *stats) {
+    lua_createtable(L, 0, 12);
+    setNumber(L, "polls", stats->polls);
+    setNumber(L, "events", stats->events);
+    setNumber(L, "events_carried", stats->carried);
+    setNumber(L, "timers_expired", stats->timers);
+    setNumber(L, "timer_batches", stats->timerBatches);
+    setNumber(L, "timers_aligned", stats->timersAligned);
+    setNumber(L, "jobs", stats->jobs);
+    
+    pushHistogram(L, &stats->wait);
+    lua_setfield(L, -2, "wait_ns");
+    pushHistogram(L, &stats->perPoll);
+    lua_setfield(L, -2, "events_per_poll");
+    pushHistogram(L, &stats->fdCallback);
+    lua_setfield(L, -2, "fd_callback_ns");
+    pushHistogram(L, &stats->timerCallback);
+    lua_setfield(L, -2, "timer_callback_ns");
+    pushHistogram(L, &stats->poolWait);
+    lua_setfield(L, -2, "pool_wait_ns");
+}
@@ -0,0 +1,67 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Loop statistics: counters and log2-bucketed histograms, cheap enough
+ * to be always on (a histogram sample is a few additions). */
+
+#ifndef __SN_STATS__
+#define __SN_STATS__
+
+#include <lua.h>
+
+#define SN_HIST_BUCKETS 40 /* bucket i counts values in [2^(i-1), 2^i); the last one also the rest */
+
+typedef struct snHistogram {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long buckets[SN_HIST_BUCKETS];
+} snHistogram;
+
+typedef struct snLoopStats {
+    unsigned long long polls;
+    unsigned long long events; /* Fired file events */
+    unsigned long long carried; /* File events left for the next iteration */
+    unsigned long long timers; /* Expired timers */
+    unsigned long long timerBatches; /* Polls which expired timers */
+    unsigned long long timersAligned; /* Expirations moved by their slack */
+    unsigned long long jobs; /* Finished thread pool jobs */
+    snHistogram wait; /* Nanoseconds spent in the backend's poll */
+    snHistogram perPoll; /* Events returned by each poll */
+    snHistogram fdCallback; /* Nanoseconds spent on file events, per poll */
+    snHistogram timerCallback; /* Nanoseconds spent on timers, per poll */
+    snHistogram poolWait; /* Nanoseconds pool jobs waited for a thread */
+} snLoopStats;
+
+static inline void snHistAdd(snHistogram *hist, unsigned long long value) {
+    int bucket = value ? 64 - __builtin_clzll(value) : 0;
+    
+    if (bucket >= SN_HIST_BUCKETS) bucket = SN_HIST_BUCKETS - 1;
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) hist->max = value;
+}
+
+unsigned long long snNanoTime(void);
+void snPushStats(lua_State *L, snLoopStats *stats);
+
+#endif
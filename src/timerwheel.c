@@ -0,0 +1,267 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include "timerwheel.h"
+
+#define levelShift(level) ((level) * SN_WHEEL_BITS)
+
+/** Puts a node in the slot matching its expiration tick.
+ * The node is stored on the lowest level, on which its tick and the current
+ * tick fall into the same parent slot.
+ **/
+static void wheelLink(snTimerWheel *wheel, int id) {
+    snWheelNode *node = &wheel->nodes[id];
+    int64_t expires = node->expires;
+    if (expires < wheel->current) expires = wheel->current;
+    
+    uint64_t diff = (uint64_t) (expires ^ wheel->current);
+    int level = diff < SN_WHEEL_SIZE ? 0 :
+            (63 - __builtin_clzll(diff)) / SN_WHEEL_BITS;
+    int index = (int) ((expires >> levelShift(level)) & SN_WHEEL_MASK);
+    int slot = level * SN_WHEEL_SIZE + index;
+    
+    node->slot = slot;
+    node->prev = -1;
+    node->next = wheel->slots[slot];
+    if (node->next != -1) wheel->nodes[node->next].prev = id;
+    wheel->slots[slot] = id;
+    wheel->occupied[level] |= 1ULL << index;
+    wheel->count++;
+}
+
+static void wheelUnlink(snTimerWheel *wheel, int id) {
+    snWheelNode *node = &wheel->nodes[id];
+    int slot = node->slot;
+    
+    if (node->prev != -1) wheel->nodes[node->prev].next = node->next;
+    else wheel->slots[slot] = node->next;
+    if (node->next != -1) wheel->nodes[node->next].prev = node->prev;
+    
+    if (wheel->slots[slot] == -1) {
+        wheel->occupied[slot / SN_WHEEL_SIZE] &= ~(1ULL << (slot & SN_WHEEL_MASK));
+    }
+    node->slot = -1;
+    wheel->count--;
+}
+
+/** Empties a slot and returns the first id of the detached list.
+ **/
+static int detach(snTimerWheel *wheel, int level, int index) {
+    int slot = level * SN_WHEEL_SIZE + index;
+    int id = wheel->slots[slot];
+    int i;
+    
+    for (i = id; i != -1; i = wheel->nodes[i].next) {
+        wheel->nodes[i].slot = -1;
+        wheel->count--;
+    }
+    wheel->slots[slot] = -1;
+    wheel->occupied[level] &= ~(1ULL << index);
+    
+    return id;
+}
+
+/** Moves timers from the higher level slots, which start at 'tick',
+ * to the lower levels.
+ **/
+static void cascade(snTimerWheel *wheel, int64_t tick) {
+    int level;
+    
+    for (level = SN_WHEEL_LEVELS - 1; level > 0; level--) {
+        int shift = levelShift(level);
+        if (tick & ((1LL << shift) - 1)) continue; /* not a slot boundary */
+        
+        int index = (int) ((tick >> shift) & SN_WHEEL_MASK);
+        if (!(wheel->occupied[level] & (1ULL << index))) continue;
+        
+        int id = detach(wheel, level, index);
+        while (id != -1) {
+            int next = wheel->nodes[id].next;
+            wheelLink(wheel, id);
+            id = next;
+        }
+    }
+}
+
+/** Rounds 'tick' up to a multiple of the largest power of two not above
+ * 'slack', so that it's at most 'slack' ticks later.
+ **/
+static int64_t alignTick(int64_t tick, int64_t slack) {
+    if (slack <= 0) return tick;
+    
+    int64_t grain = 1LL << (63 - __builtin_clzll((uint64_t) slack));
+    return (tick + grain - 1) & ~(grain - 1);
+}
+
+int snWheelInit(snTimerWheel *wheel, int64_t now) {
+    int i;
+    
+    wheel->current = now;
+    wheel->nodes = NULL;
+    wheel->size = 0;
+    wheel->freelist = -1;
+    wheel->limbo = -1;
+    wheel->count = 0;
+    wheel->aligned = 0;
+    for (i = 0; i < SN_WHEEL_LEVELS; i++) wheel->occupied[i] = 0;
+    for (i = 0; i < SN_WHEEL_LEVELS * SN_WHEEL_SIZE; i++) wheel->slots[i] = -1;
+    
+    return 0;
+}
+
+void snWheelFree(snTimerWheel *wheel) {
+    free(wheel->nodes);
+    wheel->nodes = NULL;
+    wheel->size = 0;
+}
+
+/** Schedules a new timer. 'expires' is an absolute tick; if 'interval' is
+ * greater than 0, the timer is rescheduled every time it fires. 'slack' is
+ * the number of ticks it may fire late (0 for none).
+ * Returns the timer id, or -1 when out of memory.
+ **/
+int snWheelAdd(snTimerWheel *wheel, int64_t expires, int64_t interval, int64_t slack) {
+    int id = wheel->freelist;
+    
+    if (id == -1) {
+        int size = wheel->size ? wheel->size * 2 : SN_WHEEL_SIZE;
+        snWheelNode *nodes = realloc(wheel->nodes, sizeof(snWheelNode) * size);
+        if (!nodes) return -1;
+        
+        int i;
+        for (i = size - 1; i >= wheel->size; i--) {
+            nodes[i].slot = -1;
+            nodes[i].next = wheel->freelist;
+            wheel->freelist = i;
+        }
+        wheel->nodes = nodes;
+        wheel->size = size;
+        id = wheel->freelist;
+    }
+    wheel->freelist = wheel->nodes[id].next;
+    
+    /* the current tick has been processed already */
+    if (expires <= wheel->current) expires = wheel->current + 1;
+    wheel->nodes[id].due = expires;
+    wheel->nodes[id].expires = alignTick(expires, slack);
+    wheel->nodes[id].interval = interval;
+    wheel->nodes[id].slack = slack;
+    wheelLink(wheel, id);
+    
+    return id;
+}
+
+/** Cancels a timer and releases its id. The id is not reused before the
+ * next call to snWheelExpire(), so a stale id from the batch being
+ * dispatched cannot point at a brand new timer.
+ **/
+int snWheelRemove(snTimerWheel *wheel, int id) {
+    if (id < 0 || id >= wheel->size) return -1;
+    
+    if (wheel->nodes[id].slot != -1) wheelUnlink(wheel, id);
+    wheel->nodes[id].next = wheel->limbo;
+    wheel->limbo = id;
+    
+    return 0;
+}
+
+/** Returns the earliest tick at which the wheel has some work to do
+ * (a timer to fire or a slot to cascade), or -1 if there are no timers.
+ **/
+int64_t snWheelNext(snTimerWheel *wheel) {
+    int64_t next = -1;
+    int level;
+    
+    if (wheel->count == 0) return -1;
+    
+    for (level = 0; level < SN_WHEEL_LEVELS; level++) {
+        uint64_t bits = wheel->occupied[level];
+        if (!bits) continue;
+        
+        int shift = levelShift(level);
+        int index = (int) ((wheel->current >> shift) & SN_WHEEL_MASK);
+        /* only slots after the current one are in use */
+        bits &= ~((2ULL << index) - 1);
+        if (!bits) continue;
+        
+        int parentShift = shift + SN_WHEEL_BITS;
+        int64_t base = parentShift < 63 ?
+                (wheel->current >> parentShift) << parentShift : 0;
+        int64_t tick = base | ((int64_t) __builtin_ctzll(bits) << shift);
+        
+        if (next == -1 || tick < next) next = tick;
+    }
+    
+    return next;
+}
+
+/** Advances the wheel to 'now', calling 'fn' for every timer that expired.
+ * One-shot timers stay allocated until they are removed with snWheelRemove().
+ * Returns the number of expired timers.
+ **/
+int snWheelExpire(snTimerWheel *wheel, int64_t now, snWheelCallback fn, void *udata) {
+    int fired = 0;
+    
+    /* ids removed during the previous dispatch can be reused now */
+    while (wheel->limbo != -1) {
+        int id = wheel->limbo;
+        wheel->limbo = wheel->nodes[id].next;
+        wheel->nodes[id].next = wheel->freelist;
+        wheel->freelist = id;
+    }
+    
+    while (wheel->current < now) {
+        int64_t tick = snWheelNext(wheel);
+        if (tick == -1 || tick > now) {
+            wheel->current = now;
+            break;
+        }
+        
+        wheel->current = tick;
+        cascade(wheel, tick);
+        
+        int index = (int) (tick & SN_WHEEL_MASK);
+        if (!(wheel->occupied[0] & (1ULL << index))) continue;
+        
+        int id = detach(wheel, 0, index);
+        while (id != -1) {
+            snWheelNode *node = &wheel->nodes[id];
+            int next = node->next;
+            
+            if (node->expires != node->due) wheel->aligned++;
+            if (node->interval > 0) {
+                /* periods are kept from the asked ticks, so slack doesn't
+                 * make the timer drift */
+                node->due += node->interval;
+                if (node->due <= now) node->due = now + node->interval;
+                node->expires = alignTick(node->due, node->slack);
+                wheelLink(wheel, id);
+            }
+            
+            fn(udata, id);
+            fired++;
+            id = next;
+        }
+    }
+    
+    return fired;
+}
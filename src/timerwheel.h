@@ -0,0 +1,80 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Hierarchical timing wheel.
+ *
+ * Timers are kept in SN_WHEEL_LEVELS levels of SN_WHEEL_SIZE slots each.
+ * Level 0 slots are one tick wide, level 1 slots are SN_WHEEL_SIZE ticks wide,
+ * and so on. A timer is stored on the lowest level on which it shares the
+ * parent slot with the current tick, so it never has to wait for a full
+ * revolution. When the current tick crosses the boundary of a higher level
+ * slot, the timers stored in it are moved ("cascaded") to lower levels.
+ *
+ * Adding, removing and expiring a timer is O(1). Timer ids are small
+ * integers, which are reused after the timer is removed.
+ *
+ * A timer with slack may fire up to 'slack' ticks late: its tick is rounded
+ * up to a multiple of the largest power of two not above the slack, so
+ * timers due around the same time share a tick and fire in one batch.
+ */
+
+#ifndef __SN_TIMERWHEEL__
+#define __SN_TIMERWHEEL__
+
+#include <stdint.h>
+
+#define SN_WHEEL_BITS 6
+#define SN_WHEEL_SIZE (1 << SN_WHEEL_BITS) /* Slots per level */
+#define SN_WHEEL_MASK (SN_WHEEL_SIZE - 1)
+#define SN_WHEEL_LEVELS 11 /* 11 * 6 bits covers every int64_t tick */
+
+typedef struct snWheelNode {
+    int64_t expires; /* Tick at which the timer fires */
+    int64_t interval; /* Period in ticks; 0 for one-shot timers */
+    int64_t due; /* Tick the timer asked for; 'expires' is aligned to the slack */
+    int64_t slack; /* Ticks the timer may be late */
+    int next;
+    int prev;
+    int slot; /* level * SN_WHEEL_SIZE + index; -1 when not scheduled */
+} snWheelNode;
+
+typedef struct snTimerWheel {
+    int64_t current; /* Last processed tick */
+    snWheelNode *nodes; /* Indexed by timer id */
+    int size; /* Number of slots in nodes */
+    int freelist; /* Ids ready for reuse */
+    int limbo; /* Ids removed since the last expiration */
+    int count; /* Number of scheduled timers */
+    unsigned long long aligned; /* Expirations moved by their slack */
+    uint64_t occupied[SN_WHEEL_LEVELS]; /* Bitmap of non-empty slots */
+    int slots[SN_WHEEL_LEVELS * SN_WHEEL_SIZE]; /* First timer id in each slot */
+} snTimerWheel;
+
+typedef void (*snWheelCallback)(void *udata, int id);
+
+int snWheelInit(snTimerWheel *wheel, int64_t now);
+void snWheelFree(snTimerWheel *wheel);
+int snWheelAdd(snTimerWheel *wheel, int64_t expires, int64_t interval, int64_t slack);
+int snWheelRemove(snTimerWheel *wheel, int id);
+int64_t snWheelNext(snTimerWheel *wheel);
+int snWheelExpire(snTimerWheel *wheel, int64_t now, snWheelCallback fn, void *udata);
+
+#endif
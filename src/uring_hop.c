@@ -0,0 +1,418 @@
+/* Copyright (c) 2011 Mateusz Armatys
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* io_uring backend. It is included from epoll_hop.c, shares its timer
+ * helpers, and createLoop() falls back to epoll if the ring can't be set up.
+ *
+ * Listeners are IORING_OP_POLL_ADD requests. Level-triggered listeners use
+ * single-shot polls, which are re-armed before the next wait when the fd is
+ * still registered; "+et" listeners use multishot polls. All the requests
+ * queued during an iteration are submitted by the same io_uring_enter call,
+ * that waits for completions, so a loop iteration costs one syscall. */
+
+#include <errno.h>
+#include <signal.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define SN_URING_ENTRIES 256
+#define SN_URING_IGNORE UINT64_MAX /* user_data of requests without a result */
+
+typedef struct snUringFd {
+    uint32_t gen; /* Generation of the current poll request */
+    uint32_t armed; /* Poll events armed in the kernel; 0 if none */
+    int round; /* Last poll round, in which the fd fired */
+    int fired; /* Index in hloop->fired, for that round */
+} snUringFd;
+
+typedef struct snUringState {
+    int ringfd;
+    void *ring; /* SQ and CQ rings (IORING_FEAT_SINGLE_MMAP) */
+    size_t ringsize;
+    struct io_uring_sqe *sqes;
+    size_t sqessize;
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned *sqarray;
+    unsigned sqmask;
+    unsigned sqentries;
+    unsigned sqlocal; /* Tail including the requests not submitted yet */
+    unsigned *cqhead;
+    unsigned *cqtail;
+    struct io_uring_cqe *cqes;
+    unsigned cqmask;
+    snUringFd *fds; /* hloop->setsize slots */
+    int *rearm; /* Fds to re-arm before the next wait */
+    int nrearm;
+    int round;
+    snTimerWheel wheel;
+} snUringState;
+
+static int uringCloseLoop(struct snHopLoop *hloop);
+static int uringResize(struct snHopLoop *hloop, int setsize);
+static int uringAddEvent(struct snHopLoop *hloop, int fd, int mask);
+static int uringRemoveEvent(struct snHopLoop *hloop, int fd, int mask);
+static int uringRearmEvent(struct snHopLoop *hloop, int fd);
+static int uringPoll(struct snHopLoop *hloop, struct timespec *tsp);
+static int uringSetTimeout(struct snHopLoop *hloop, struct timeval *tvp, int slack);
+static int uringSetInterval(struct snHopLoop *hloop, struct timeval *tvp, int slack);
+static int uringClearTimer(struct snHopLoop *hloop, int fd);
+
+static int uringInit(snUringState *state) {
+    struct io_uring_params p;
+    
+    memset(&p, 0, sizeof(p));
+    int ringfd = syscall(__NR_io_uring_setup, SN_URING_ENTRIES, &p);
+    if (ringfd == -1) return -1;
+    
+    /* EXT_ARG (5.11) gives waits with a timeout; RSRC_TAGS came with
+     * multishot poll in 5.13 */
+    unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+            IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS;
+    if ((p.features & required) != required) {
+        close(ringfd);
+        return -1;
+    }
+    
+    size_t sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    state->ringsize = sqsize > cqsize ? sqsize : cqsize;
+    state->ring = mmap(NULL, state->ringsize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if (state->ring == MAP_FAILED) {
+        close(ringfd);
+        return -1;
+    }
+    
+    state->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqessize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        munmap(state->ring, state->ringsize);
+        close(ringfd);
+        return -1;
+    }
+    
+    char *ring = state->ring;
+    state->ringfd = ringfd;
+    state->sqhead = (unsigned *) (ring + p.sq_off.head);
+    state->sqtail = (unsigned *) (ring + p.sq_off.tail);
+    state->sqarray = (unsigned *) (ring + p.sq_off.array);
+    state->sqmask = *(unsigned *) (ring + p.sq_off.ring_mask);
+    state->sqentries = *(unsigned *) (ring + p.sq_off.ring_entries);
+    state->sqlocal = *state->sqtail;
+    state->cqhead = (unsigned *) (ring + p.cq_off.head);
+    state->cqtail = (unsigned *) (ring + p.cq_off.tail);
+    state->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+    state->cqmask = *(unsigned *) (ring + p.cq_off.ring_mask);
+    
+    return 0;
+}
+
+static int createUringLoop(snHopLoop *hloop) {
+    snLoopApi *api = malloc(sizeof(snLoopApi));
+    snUringState *state = malloc(sizeof(snUringState));
+    
+    if (! (api && state) || uringInit(state) == -1) {
+        free(api);
+        free(state);
+        return -1;
+    }
+    
+    state->fds = NULL;
+    state->rearm = NULL;
+    state->nrearm = 0;
+    state->round = 0;
+    snWheelInit(&state->wheel, getTick());
+    
+    hloop->api = api;
+    hloop->state = state;
+    
+    api->name = "io_uring";
+    api->closeLoop = uringCloseLoop;
+    api->resize = uringResize;
+    api->addEvent = uringAddEvent;
+    api->removeEvent = uringRemoveEvent;
+    api->rearmEvent = uringRearmEvent;
+    api->poll = uringPoll;
+    api->setTimeout = uringSetTimeout;
+    api->setInterval = uringSetInterval;
+    api->clearTimer = uringClearTimer;
+    
+    return 0;
+}
+
+static int uringCloseLoop(struct snHopLoop *hloop) {
+    snUringState *state = hloop->state;
+    
+    munmap(state->sqes, state->sqessize);
+    munmap(state->ring, state->ringsize);
+    close(state->ringfd);
+    free(state->fds);
+    free(state->rearm);
+    snWheelFree(&state->wheel);
+    
+    return 0;
+}
+
+static int uringResize(struct snHopLoop *hloop, int setsize) {
+    snUringState *state = hloop->state;
+    
+    snUringFd *fds = realloc(state->fds, sizeof(snUringFd) * setsize);
+    if (!fds) return -1;
+    memset(fds + hloop->setsize, 0, sizeof(snUringFd) * (setsize - hloop->setsize));
+    state->fds = fds;
+    
+    int *rearm = realloc(state->rearm, sizeof(int) * setsize);
+    if (!rearm) return -1;
+    state->rearm = rearm;
+    
+    return 0;
+}
+
+/** Submits the queued requests and, if 'wait' is set, waits for completions
+ * until the timeout (NULL waits forever).
+ **/
+static int uringEnter(snUringState *state, int wait, struct __kernel_timespec *ts) {
+    struct io_uring_getevents_arg arg;
+    unsigned flags = 0;
+    
+    __atomic_store_n(state->sqtail, state->sqlocal, __ATOMIC_RELEASE);
+    unsigned submit = state->sqlocal - __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE);
+    if (!submit && !wait) return 0;
+    
+    memset(&arg, 0, sizeof(arg));
+    if (wait) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uint64_t) (uintptr_t) ts;
+    }
+    
+    int ret = syscall(__NR_io_uring_enter, state->ringfd, submit, wait ? 1 : 0,
+            flags, wait ? &arg : NULL, sizeof(arg));
+    if (ret == -1 && (errno == ETIME || errno == EINTR || errno == EBUSY)) return 0;
+    
+    return ret;
+}
+
+/** Returns a zeroed submission entry, or NULL if the ring is full
+ * even after submitting the queued requests.
+ **/
+static struct io_uring_sqe *uringGetSqe(snUringState *state) {
+    unsigned head = __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE);
+    
+    if (state->sqlocal - head >= state->sqentries) {
+        uringEnter(state, 0, NULL);
+        head = __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE);
+        if (state->sqlocal - head >= state->sqentries) return NULL;
+    }
+    
+    unsigned index = state->sqlocal & state->sqmask;
+    struct io_uring_sqe *sqe = &state->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    state->sqarray[index] = index;
+    state->sqlocal++;
+    
+    return sqe;
+}
+
+static uint32_t getPollEvents(int mask) {
+    uint32_t events = 0;
+    
+    /* poll(2) and epoll share the values of these bits */
+    if (mask & SN_READABLE) events |= EPOLLIN;
+    if (mask & SN_WANTWRITE) events |= EPOLLOUT;
+    if (mask & SN_EXCLUSIVE) events |= EPOLLEXCLUSIVE;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = __swahw32(events);
+#endif
+    
+    return events;
+}
+
+static uint64_t getUserData(snUringState *state, int fd) {
+    return ((uint64_t) state->fds[fd].gen << 32) | (uint32_t) fd;
+}
+
+/** Cancels the poll request of 'fd', if there is one.
+ **/
+static int uringDisarm(snUringState *state, int fd) {
+    snUringFd *f = &state->fds[fd];
+    if (!f->armed) return 0;
+    
+    struct io_uring_sqe *sqe = uringGetSqe(state);
+    if (!sqe) return -1;
+    
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = getUserData(state, fd);
+    sqe->user_data = SN_URING_IGNORE;
+    f->armed = 0;
+    f->gen++; /* late completions of the old request are ignored */
+    
+    return 0;
+}
+
+/** Queues a poll request for 'fd' with the listener 'mask'.
+ **/
+static int uringArm(snUringState *state, int fd, int mask) {
+    snUringFd *f = &state->fds[fd];
+    struct io_uring_sqe *sqe = uringGetSqe(state);
+    if (!sqe) return -1;
+    
+    f->gen++;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = getPollEvents(mask);
+    sqe->user_data = getUserData(state, fd);
+    if ((mask & SN_EDGE) && !(mask & SN_ONESHOT)) sqe->len = IORING_POLL_ADD_MULTI;
+    f->armed = sqe->poll32_events;
+    
+    return 0;
+}
+
+static int uringAddEvent(struct snHopLoop *hloop, int fd, int mask) {
+    snUringState *state = hloop->state;
+    
+    mask |= hloop->events[fd].mask; /* Merge old events */
+    if (uringDisarm(state, fd) == -1) return -1;
+    
+    return uringArm(state, fd, mask);
+}
+
+static int uringRemoveEvent(struct snHopLoop *hloop, int fd, int delmask) {
+    snUringState *state = hloop->state;
+    int mask = hloop->events[fd].mask & (~delmask);
+    
+    uringDisarm(state, fd);
+    if (mask & SN_POLLED) uringArm(state, fd, mask);
+    
+    return 0;
+}
+
+static int uringRearmEvent(struct snHopLoop *hloop, int fd) {
+    snUringState *state = hloop->state;
+    if (state->fds[fd].armed) return 0;
+    
+    return uringArm(state, fd, hloop->events[fd].mask);
+}
+
+static int uringSetTimeout(struct snHopLoop *hloop, struct timeval *tvp, int slack) {
+    snUringState *state = hloop->state;
+    return snWheelAdd(&state->wheel, getArmTick() + toTicks(tvp), 0, slack);
+}
+
+static int uringSetInterval(struct snHopLoop *hloop, struct timeval *tvp, int slack) {
+    snUringState *state = hloop->state;
+    int64_t interval = toTicks(tvp);
+    if (interval < 1) interval = 1;
+    
+    return snWheelAdd(&state->wheel, getArmTick() + interval, interval, slack);
+}
+
+static int uringClearTimer(struct snHopLoop *hloop, int fd) {
+    snUringState *state = hloop->state;
+    return snWheelRemove(&state->wheel, fd);
+}
+
+/** Re-arms the single-shot polls, which completed in the previous round,
+ * for fds that are still registered.
+ **/
+static void uringRearmFired(snHopLoop *hloop, snUringState *state) {
+    int i;
+    
+    for (i = 0; i < state->nrearm; i++) {
+        int fd = state->rearm[i];
+        int mask = hloop->events[fd].mask;
+        
+        if (state->fds[fd].armed) continue; /* re-registered meanwhile */
+        if (!(mask & SN_POLLED)) continue;
+        if (mask & SN_ONESHOT) continue; /* waits for loop:rearm() */
+        uringArm(state, fd, mask);
+    }
+    state->nrearm = 0;
+}
+
+static int uringPoll(struct snHopLoop *hloop, struct timespec *tsp) {
+    snUringState *state = hloop->state;
+    struct __kernel_timespec ts;
+    int numevents = 0;
+    
+    uringRearmFired(hloop, state);
+    
+    int64_t wait = getWaitNanos(&state->wheel, tsp);
+    ts.tv_sec = wait / 1000000000LL;
+    ts.tv_nsec = wait % 1000000000LL;
+    /* a zero timeout only submits, if there is anything to submit; the
+     * completions already in the ring are read either way */
+    uringEnter(state, wait != 0, wait == -1 ? NULL : &ts);
+    
+    unsigned head = *state->cqhead;
+    unsigned tail = __atomic_load_n(state->cqtail, __ATOMIC_ACQUIRE);
+    state->round++;
+    
+    /* completions that don't fit stay in the ring until the next poll */
+    while (head != tail && numevents < hloop->firedsize) {
+        struct io_uring_cqe *cqe = &state->cqes[head & state->cqmask];
+        uint64_t data = cqe->user_data;
+        int fd = (int) (uint32_t) data;
+        head++;
+        
+        if (data == SN_URING_IGNORE || fd >= hloop->setsize) continue;
+        snUringFd *f = &state->fds[fd];
+        if (f->gen != (uint32_t) (data >> 32)) continue; /* stale request */
+        
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            f->armed = 0;
+            state->rearm[state->nrearm++] = fd;
+        }
+        if (cqe->res == -ECANCELED) continue;
+        
+        int registered = 0;
+        int mask = 0;
+        if (hloop->events[fd].mask & SN_READABLE) registered |= SN_READABLE;
+        if (hloop->events[fd].mask & SN_WANTWRITE) registered |= SN_WRITABLE;
+        if (cqe->res < 0 || (cqe->res & (EPOLLERR | EPOLLHUP))) {
+            mask = registered; /* let the callbacks find out about the error */
+        } else {
+            if (cqe->res & EPOLLIN) mask |= SN_READABLE;
+            if (cqe->res & EPOLLOUT) mask |= SN_WRITABLE;
+            mask &= registered;
+        }
+        if (!mask) continue;
+        
+        /* multishot polls may complete a few times in one round */
+        if (f->round == state->round) {
+            hloop->fired[f->fired].mask |= mask;
+            continue;
+        }
+        f->round = state->round;
+        f->fired = numevents;
+        hloop->fired[numevents].fd = fd;
+        hloop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cqhead, head, __ATOMIC_RELEASE);
+    
+    return expireTimers(hloop, &state->wheel, numevents);
+}
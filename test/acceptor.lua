@@ -0,0 +1,36 @@
+-- Regression checks for loop:acceptor, run against each available backend.
+--
+-- usage: lua test/acceptor.lua
+
+require "luahop"
+require "benchutil"
+
+local BACKENDS = {"epoll", "io_uring", "kqueue"}
+
+-- An error before any connection was accepted gives a batch acceptor nil
+-- and the message, as it does without batch. Accepting on a connected
+-- socket, which its peer makes readable, fails.
+local function batchError(loop)
+	local a, b = benchutil.socketpair()
+	local got
+	loop:acceptor(a, function(loop, fds, err) got = {fds, err} end, {batch=true})
+	benchutil.write(b, "x")
+	loop:poll({ms=100})
+	loop:rmlistener(a, "r")
+	benchutil.close(a)
+	benchutil.close(b)
+	assert(got, "the callback wasn't called")
+	assert(got[1] == nil, "the callback got " .. type(got[1]))
+	assert(type(got[2]) == "string", "the callback got no error message")
+end
+
+local failed = 0
+for _, backend in ipairs(BACKENDS) do
+	local ok, loop = pcall(luahop.new, backend)
+	if ok then
+		local ok, err = pcall(batchError, loop)
+		print(string.format("%-8s batchError: %s", backend, ok and "ok" or err))
+		if not ok then failed = failed + 1 end
+	end
+end
+os.exit(failed == 0 and 0 or 1)
@@ -0,0 +1,57 @@
+-- Regression checks for loop:setdeadline, run against each available backend.
+--
+-- usage: lua test/deadline.lua
+
+require "luahop"
+require "benchutil"
+
+local BACKENDS = {"epoll", "io_uring", "kqueue"}
+
+-- loop:discard drops only the write queue: the deadline, which is linked
+-- through the same per-fd data, survives it and still expires.
+local function discardWithDeadline(loop)
+	local a, b = benchutil.socketpair()
+	local expired = 0
+	loop:setdeadline(b, {ms=10}, function() expired = expired + 1 end)
+	loop:write(b, "hello")
+	loop:discard(b)
+	loop:touch(b)
+	loop:poll({ms=150})
+	benchutil.close(a)
+	benchutil.close(b)
+	assert(expired == 1, "the deadline expired " .. expired .. " times")
+end
+
+-- A touch late in an iteration counts from the time it's made, not from the
+-- start of the iteration: the deadline never fires before 'timeout' passed
+-- since the last touch.
+local function touchLate(loop)
+	local a, b = benchutil.socketpair()
+	local expired
+	loop:poll({ms=0})
+	loop:setdeadline(b, {ms=200}, function() expired = benchutil.now() end)
+	local touched = benchutil.now() + 0.15
+	while benchutil.now() < touched do end
+	touched = benchutil.now()
+	loop:touch(b)
+	while not expired and benchutil.now() - touched < 1 do loop:poll({ms=50}) end
+	benchutil.close(a)
+	benchutil.close(b)
+	assert(expired, "the deadline didn't expire")
+	assert(expired - touched >= 0.2, "expired " .. (expired - touched) .. " s after the touch")
+end
+
+local TESTS = {discardWithDeadline = discardWithDeadline, touchLate = touchLate}
+
+local failed = 0
+for _, backend in ipairs(BACKENDS) do
+	local ok, loop = pcall(luahop.new, backend)
+	if ok then
+		for _, name in ipairs({"discardWithDeadline", "touchLate"}) do
+			local ok, err = pcall(TESTS[name], loop)
+			print(string.format("%-8s %s: %s", backend, name, ok and "ok" or err))
+			if not ok then failed = failed + 1 end
+		end
+	end
+end
+os.exit(failed == 0 and 0 or 1)
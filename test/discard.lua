@@ -0,0 +1,34 @@
+-- Regression checks for loop:discard, run against each available backend.
+--
+-- usage: lua test/discard.lua
+
+require "luahop"
+require "benchutil"
+
+local BACKENDS = {"epoll", "io_uring", "kqueue"}
+
+-- The handler of a native fd lives in the same per-fd data as the write
+-- queue; discarding the queue must leave the handler in place.
+local function discardNative(loop)
+	local a, b = benchutil.socketpair()
+	local batches = 0
+	loop:datagram(b, function() batches = batches + 1 end)
+	loop:discard(b)
+	benchutil.write(a, "hello")
+	loop:poll({ms=100})
+	loop:rmlistener(b, "r")
+	benchutil.close(a)
+	benchutil.close(b)
+	assert(batches == 1, "the handler ran " .. batches .. " times")
+end
+
+local failed = 0
+for _, backend in ipairs(BACKENDS) do
+	local ok, loop = pcall(luahop.new, backend)
+	if ok then
+		local ok, err = pcall(discardNative, loop)
+		print(string.format("%-8s discardNative: %s", backend, ok and "ok" or err))
+		if not ok then failed = failed + 1 end
+	end
+end
+os.exit(failed == 0 and 0 or 1)
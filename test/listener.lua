@@ -0,0 +1,100 @@
+-- Regression checks for listener changes, run against each available backend.
+--
+-- usage: lua test/listener.lua
+
+require "luahop"
+require "benchutil"
+
+local BACKENDS = {"epoll", "io_uring", "kqueue"}
+
+-- A removed listener must not leave its open file watched: after a dup
+-- keeps the file open, the fd is closed and its number goes to a socket
+-- nobody wrote to, which must not look readable.
+local function reuseAfterDup(loop)
+	local a, b = benchutil.socketpair()
+	benchutil.write(a, "x")
+	loop:setlistener(b, "r", function() end)
+	loop:poll({ms=0})
+	local copy = benchutil.dup(b)
+	loop:rmlistener(b, "r")
+	benchutil.close(b)
+	
+	local c, d = benchutil.socketpair()
+	local fd = c == b and c or d
+	assert(fd == b, "the fd number was not reused")
+	local fired = 0
+	loop:setlistener(fd, "r", function() fired = fired + 1 end)
+	for i = 1, 3 do loop:poll({ms=10}) end
+	loop:rmlistener(fd, "r")
+	for _, x in ipairs({a, copy, c, d}) do benchutil.close(x) end
+	assert(fired == 0, "the new fd fired " .. fired .. " times")
+end
+
+-- The number of a closed fd, reused within one iteration, gets its events.
+local function reuseInIteration(loop)
+	local a, b = benchutil.socketpair()
+	loop:setlistener(b, "r", function() end)
+	loop:poll({ms=0})
+	loop:rmlistener(b, "r")
+	benchutil.close(b)
+	
+	local c, d = benchutil.socketpair()
+	local fd, peer = c, d
+	if d == b then fd, peer = d, c end
+	local fired = 0
+	loop:setlistener(fd, "r", function() fired = fired + 1; loop:rmlistener(fd, "r") end)
+	benchutil.write(peer, "x")
+	loop:poll({ms=100})
+	for _, x in ipairs({a, c, d}) do benchutil.close(x) end
+	assert(fired == 1, "the new fd fired " .. fired .. " times")
+end
+
+-- Fds handled in C (here the signalfd of loop:onsignal, which takes the
+-- lowest free number) are removed by their owner, not by loop:rmlistener;
+-- a datagram listener, which has a Lua callback, is.
+local function removeNative(loop)
+	local a, b = benchutil.socketpair()
+	benchutil.close(a)
+	benchutil.close(b)
+	if pcall(loop.onsignal, loop, "USR1", function() end) then
+		assert(not pcall(loop.rmlistener, loop, a, "r"), "the signalfd was removed")
+		loop:onsignal("USR1", nil)
+	end
+	
+	local c, d = benchutil.socketpair()
+	loop:datagram(c, function() end)
+	loop:rmlistener(c, "r")
+	benchutil.close(c)
+	benchutil.close(d)
+end
+
+-- A mode has one owner: a listener can't take it from a waiting coroutine,
+-- which still gets resumed for it.
+local function listenerOnWaiter(loop)
+	local a, b = benchutil.socketpair()
+	local resumed = false
+	coroutine.wrap(function() loop:wait(b, "r"); resumed = true end)()
+	assert(not pcall(loop.setlistener, loop, b, "rw", function() end), "the wait was replaced")
+	benchutil.write(a, "x")
+	loop:poll({ms=100})
+	benchutil.close(a)
+	benchutil.close(b)
+	assert(resumed, "the waiting coroutine was not resumed")
+end
+
+local TESTS = {reuseAfterDup = reuseAfterDup, reuseInIteration = reuseInIteration,
+	removeNative = removeNative, listenerOnWaiter = listenerOnWaiter}
+
+local failed = 0
+for _, backend in ipairs(BACKENDS) do
+	local ok, loop = pcall(luahop.new, backend)
+	if ok then
+		for _, name in ipairs({"reuseAfterDup", "reuseInIteration", "removeNative",
+				"listenerOnWaiter"}) do
+			local ok, err = pcall(TESTS[name], loop)
+			print(string.format("%-8s %s: %s", backend, name, ok and "ok" or err))
+			if not ok then failed = failed + 1 end
+		end
+	end
+end
+os.exit(failed == 0 and 0 or 1)
@@ -0,0 +1,42 @@
+-- Regression checks for the mode argument of callbacks, run against each
+-- available backend.
+--
+-- usage: lua test/modes.lua
+
+require "luahop"
+require "benchutil"
+
+local BACKENDS = {"epoll", "io_uring", "kqueue"}
+
+-- Removing the "r" listener of an fd without a Lua callback (here the
+-- signalfd of loop:onsignal, which takes the lowest free number) must not
+-- lose the "r" passed to the callbacks of other fds.
+local function modeAfterRemove(loop)
+	local a, b = benchutil.socketpair()
+	benchutil.close(a)
+	benchutil.close(b)
+	if not pcall(loop.onsignal, loop, "USR1", function() end) then return end
+	pcall(loop.rmlistener, loop, a, "r")
+	
+	local c, d = benchutil.socketpair()
+	local mode
+	loop:setlistener(c, "r", function(loop, fd, m) mode = m end)
+	benchutil.write(d, "x")
+	loop:poll({ms=100})
+	loop:rmlistener(c, "r")
+	loop:onsignal("USR1", nil)
+	benchutil.close(c)
+	benchutil.close(d)
+	assert(mode == "r", "the callback got " .. tostring(mode))
+end
+
+local failed = 0
+for _, backend in ipairs(BACKENDS) do
+	local ok, loop = pcall(luahop.new, backend)
+	if ok then
+		local ok, err = pcall(modeAfterRemove, loop)
+		print(string.format("%-8s modeAfterRemove: %s", backend, ok and "ok" or err))
+		if not ok then failed = failed + 1 end
+	end
+end
+os.exit(failed == 0 and 0 or 1)
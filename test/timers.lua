@@ -0,0 +1,32 @@
+-- Regression checks for timers, run against each available backend.
+--
+-- usage: lua test/timers.lua
+
+require "luahop"
+require "benchutil"
+
+local BACKENDS = {"epoll", "io_uring", "kqueue"}
+
+-- A timeout never fires before it elapsed, wherever in a millisecond of
+-- the wheel it was armed.
+local function neverEarly(loop)
+	for i = 1, 100 do
+		local us = math.random(1000, 5000)
+		local armed, fired = benchutil.now()
+		loop:settimeout({us=us}, function() fired = benchutil.now() end)
+		while not fired do loop:poll() end
+		local waited = (fired - armed) * 1e6
+		assert(waited >= us, string.format("a %d us timeout fired after %.0f us", us, waited))
+	end
+end
+
+local failed = 0
+for _, backend in ipairs(BACKENDS) do
+	local ok, loop = pcall(luahop.new, backend)
+	if ok then
+		local ok, err = pcall(neverEarly, loop)
+		print(string.format("%-8s neverEarly: %s", backend, ok and "ok" or err))
+		if not ok then failed = failed + 1 end
+	end
+end
+os.exit(failed == 0 and 0 or 1)
@@ -0,0 +1,74 @@
+-- Regression checks for the write queue, run against each available backend.
+--
+-- usage: lua test/write.lua
+
+require "luahop"
+require "benchutil"
+
+local BACKENDS = {"epoll", "io_uring", "kqueue"}
+
+-- A write over the queue limit fails without sending any of its bytes, so
+-- writing it again later doesn't duplicate them.
+local function fullQueue(loop)
+	local a, b = benchutil.socketpair()
+	loop:writeopts(a, {max=1000})
+	local n, err = loop:write(a, string.rep("x", 4 * 1024 * 1024))
+	local got = benchutil.read(b)
+	assert(n == nil and err, "the write didn't fail")
+	assert(got == "", #got .. " bytes of a failed write were sent")
+	loop:discard(a)
+	benchutil.close(a)
+	benchutil.close(b)
+end
+
+-- Without a high watermark, starting a queue doesn't call highwater.
+local function noHighWatermark(loop)
+	local a, b = benchutil.socketpair()
+	local calls = 0
+	loop:writeopts(a, {drain=function() end, highwater=function() calls = calls + 1 end})
+	loop:write(a, string.rep("x", 4 * 1024 * 1024))
+	loop:discard(a)
+	benchutil.close(a)
+	benchutil.close(b)
+	assert(calls == 0, "highwater was called " .. calls .. " times")
+end
+
+-- A queue callback which replaces the read listener, in an iteration where
+-- the fd is readable too, has the new listener called, not the old one.
+local function drainReplacesListener(loop)
+	local a, b = benchutil.socketpair()
+	local data = string.rep("x", 1024 * 1024)
+	local queued = loop:write(a, data)
+	local left = #data - queued
+	while left > 0 do left = left - #benchutil.read(b) end
+	
+	local calls = {}
+	loop:setlistener(a, "r", function() calls[#calls + 1] = "old" end)
+	-- any progress of the queue calls drain
+	loop:writeopts(a, {low=queued - 1, drain=function(loop, fd)
+		loop:setlistener(fd, "r", function() calls[#calls + 1] = "new" end)
+	end})
+	benchutil.write(b, "ping")
+	loop:poll({ms=100})
+	loop:rmlistener(a, "r")
+	loop:discard(a)
+	benchutil.close(a)
+	benchutil.close(b)
+	assert(table.concat(calls, ",") == "new", "called: " .. table.concat(calls, ","))
+end
+
+local TESTS = {fullQueue = fullQueue, noHighWatermark = noHighWatermark,
+	drainReplacesListener = drainReplacesListener}
+
+local failed = 0
+for _, backend in ipairs(BACKENDS) do
+	local ok, loop = pcall(luahop.new, backend)
+	if ok then
+		for _, name in ipairs({"fullQueue", "noHighWatermark", "drainReplacesListener"}) do
+			local ok, err = pcall(TESTS[name], loop)
+			print(string.format("%-8s %s: %s", backend, name, ok and "ok" or err))
+			if not ok then failed = failed + 1 end
+		end
+	end
+end
+os.exit(failed == 0 and 0 or 1)